@@ -0,0 +1,212 @@
+// 加速结构的磁盘缓存：四叉树和BVH只用编号引用entity，构建后原样写入文件，之后的运行直接只读映射，
+// 同一台机器上的多个渲染进程共享映射的页面
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include <list>
+#include <chrono>
+#include <typeinfo>
+#include "MappedFile.h"
+#include "QuadTree.h"
+#include "BVH.h"
+#include "Settings.h"
+
+#define ACCEL_CACHE_MAGIC 0x4c434341u	//"ACCL"
+#define ACCEL_CACHE_VERSION 1			//节点格式或构建算法改变时加一，旧的缓存自动失效
+
+//文件头，后面依次是节点数组和counts[1]、counts[2]个int32的编号数组，都按4字节对齐
+struct AccelCacheHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t accel;			//AccelType
+	int32_t param;			//四叉树的最大深度
+	uint64_t hash;			//场景和构建参数的哈希，同时决定文件名
+	uint32_t entity_count;
+	int32_t depth;			//四叉树的实际深度
+	uint32_t counts[3];		//四叉树：节点数、entity编号数、0；BVH：节点数、叶节点编号数、无界entity数
+	uint32_t node_size;		//sizeof(节点)，不同编译器的结构体布局不同时拒绝加载
+};
+
+class AccelCache
+{
+protected:
+	MappedFile m_file;
+	std::string m_path;
+	bool m_loaded;			//上次Get是否来自缓存
+
+	static void HashBytes(uint64_t& hash, const void* data, size_t size)
+	{
+		const unsigned char* p = (const unsigned char*)data;
+		for (size_t i = 0; i < size; i++)
+			hash = (hash ^ p[i]) * 1099511628211ull;
+	}
+	//构建只依赖每个entity的shape类型(决定Contained的行为)和包围盒，以及构建参数
+	template<typename T> static uint64_t Hash(const std::list<T*>& data, AccelType accel, int param)
+	{
+		uint64_t hash = 14695981039346656037ull;
+		int header[] = { ACCEL_CACHE_VERSION, (int)accel, param, (int)data.size(), QUADTREE_MAX_DEPTH, BVH_LEAF_SIZE, BVH_BIN_NUM, BVH_MAX_DEPTH };
+		float constants[] = { (float)MIN_NODE_SIZE, (float)EPSILON };
+		HashBytes(hash, header, sizeof(header));
+		HashBytes(hash, constants, sizeof(constants));
+		for (auto item : data)
+		{
+			const char* type = typeid(*item->GetShape()).name();
+			HashBytes(hash, type, strlen(type) + 1);
+			float b[4] = { 0.f, 0.f, 0.f, 0.f };
+			bool bounded = item->GetBound(b[0], b[1], b[2], b[3]);
+			HashBytes(hash, &bounded, sizeof(bounded));
+			HashBytes(hash, b, sizeof(b));
+		}
+		return hash;
+	}
+	std::string GetPath(const std::string& dir, uint64_t hash)
+	{
+		char name[32];
+		snprintf(name, sizeof(name), "accel_%016llx.bin", (unsigned long long)hash);
+		return dir.empty() || dir.back() == '/' || dir.back() == '\\' ? dir + name : dir + "/" + name;
+	}
+	//映射文件并检查文件头和各数组的长度，成功时返回文件头
+	const AccelCacheHeader* Map(AccelType accel, uint64_t hash, int entity_count, size_t node_size)
+	{
+		if (!m_file.Open(m_path) || m_file.GetSize() < sizeof(AccelCacheHeader))
+			return NULL;
+		const AccelCacheHeader* h = (const AccelCacheHeader*)m_file.GetData();
+		size_t size = sizeof(AccelCacheHeader) + (size_t)h->counts[0] * node_size + ((size_t)h->counts[1] + h->counts[2]) * sizeof(int32_t);
+		if (h->magic != ACCEL_CACHE_MAGIC || h->version != ACCEL_CACHE_VERSION || h->accel != (uint32_t)accel || h->hash != hash
+			|| h->entity_count != (uint32_t)entity_count || h->node_size != node_size || h->counts[0] == 0 || size != m_file.GetSize())
+			return NULL;
+		return h;
+	}
+	static bool ValidIndices(const int* indices, int count, int entity_count)
+	{
+		for (int i = 0; i < count; i++)
+			if (indices[i] < 0 || indices[i] >= entity_count)
+				return false;
+		return true;
+	}
+	//子节点编号总是大于父节点，按顺序一遍就能求出每个节点的深度，深度不超过遍历栈的大小
+	static bool ValidQuadTree(const QuadNode* nodes, int node_count, int index_count, int max_depth)
+	{
+		std::vector<int> depth(node_count, 0);
+		for (int i = 0; i < node_count; i++)
+		{
+			const QuadNode& n = nodes[i];
+			if (n.first < 0 || n.count < 0 || n.first > index_count - n.count || depth[i] > max_depth)
+				return false;
+			for (int k = 0; k < 4; k++)
+			{
+				if (n.child[k] == -1) continue;
+				if (n.child[k] <= i || n.child[k] >= node_count)
+					return false;
+				depth[n.child[k]] = std::max(depth[n.child[k]], depth[i] + 1);
+			}
+		}
+		return true;
+	}
+	static bool ValidBVH(const BVHNode* nodes, int node_count, int order_count)
+	{
+		std::vector<int> depth(node_count, 0);
+		for (int i = 0; i < node_count; i++)
+		{
+			const BVHNode& n = nodes[i];
+			if (depth[i] >= BVH_MAX_DEPTH)
+				return false;
+			if (n.count > 0)
+			{
+				if (n.first < 0 || n.first > order_count - n.count)
+					return false;
+				continue;
+			}
+			if (n.count < 0 || i + 1 >= node_count || n.first <= i + 1 || n.first >= node_count)
+				return false;
+			depth[i + 1] = std::max(depth[i + 1], depth[i] + 1);
+			depth[n.first] = std::max(depth[n.first], depth[i] + 1);
+		}
+		return true;
+	}
+	//先写临时文件再改名，其他进程不会映射到写了一半的文件
+	bool Write(AccelCacheHeader header, const void* nodes, size_t node_size, const int* a, const int* b)
+	{
+		std::string tmp = m_path + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+		FILE* fp = fopen(tmp.c_str(), "wb");
+		if (!fp) return false;
+		bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && fwrite(nodes, node_size, header.counts[0], fp) == header.counts[0];
+		ok = ok && fwrite(a, sizeof(int32_t), header.counts[1], fp) == header.counts[1];
+		ok = ok && fwrite(b, sizeof(int32_t), header.counts[2], fp) == header.counts[2];
+		ok = fclose(fp) == 0 && ok;
+		if (ok && rename(tmp.c_str(), m_path.c_str()) == 0)
+			return true;
+		remove(tmp.c_str());
+		return false;
+	}
+public:
+	AccelCache() : m_loaded(false) {}
+	//释放映射，用映射数据创建的加速结构要先销毁
+	void Close()
+	{
+		m_file.Close();
+		m_loaded = false;
+	}
+	bool IsLoaded() { return m_loaded; }
+	const std::string& GetPath() { return m_path; }
+	//从dir中的缓存映射四叉树，没有或无效时重新构建并写入缓存
+	template<typename T> QuadTree<T>* GetQuadTree(const std::string& dir, const std::list<T*>& data, int max_depth)
+	{
+		Close();
+		uint64_t hash = Hash(data, ACCEL_QUADTREE, max_depth);
+		m_path = GetPath(dir, hash);
+		const AccelCacheHeader* h = Map(ACCEL_QUADTREE, hash, (int)data.size(), sizeof(QuadNode));
+		if (h && h->counts[2] == 0)
+		{
+			const QuadNode* nodes = (const QuadNode*)(h + 1);
+			const int* indices = (const int*)(nodes + h->counts[0]);
+			if (h->depth >= 0 && h->depth <= QUADTREE_MAX_DEPTH && ValidQuadTree(nodes, h->counts[0], h->counts[1], h->depth)
+				&& ValidIndices(indices, h->counts[1], (int)data.size()))
+			{
+				m_loaded = true;
+				return new QuadTree<T>(data, nodes, h->counts[0], indices, h->counts[1], h->depth);
+			}
+		}
+		m_file.Close();
+		QuadTree<T>* tree = new QuadTree<T>(data, max_depth);
+		AccelCacheHeader header = { ACCEL_CACHE_MAGIC, ACCEL_CACHE_VERSION, ACCEL_QUADTREE, max_depth, hash, (uint32_t)data.size(), tree->GetDepth(),
+			{ (uint32_t)tree->GetNodeCount(), (uint32_t)tree->GetIndexCount(), 0 }, sizeof(QuadNode) };
+		Write(header, tree->GetNodes(), sizeof(QuadNode), tree->GetIndices(), NULL);
+		return tree;
+	}
+	//从dir中的缓存映射BVH，没有或无效时重新构建并写入缓存
+	template<typename T> BVH<T>* GetBVH(const std::string& dir, const std::list<T*>& data)
+	{
+		Close();
+		uint64_t hash = Hash(data, ACCEL_BVH, 0);
+		m_path = GetPath(dir, hash);
+		const AccelCacheHeader* h = Map(ACCEL_BVH, hash, (int)data.size(), sizeof(BVHNode));
+		if (h)
+		{
+			const BVHNode* nodes = (const BVHNode*)(h + 1);
+			const int* order = (const int*)(nodes + h->counts[0]);
+			const int* unbounded = order + h->counts[1];
+			if (ValidBVH(nodes, h->counts[0], h->counts[1]) && ValidIndices(order, h->counts[1], (int)data.size())
+				&& ValidIndices(unbounded, h->counts[2], (int)data.size()))
+			{
+				m_loaded = true;
+				return new BVH<T>(data, nodes, h->counts[0], order, h->counts[1], unbounded, h->counts[2]);
+			}
+		}
+		m_file.Close();
+		BVH<T>* bvh = new BVH<T>(data);
+		//没有有界entity时BVH没有节点，不值得缓存
+		if (bvh->GetNodeCount() > 0)
+		{
+			AccelCacheHeader header = { ACCEL_CACHE_MAGIC, ACCEL_CACHE_VERSION, ACCEL_BVH, 0, hash, (uint32_t)data.size(), 0,
+				{ (uint32_t)bvh->GetNodeCount(), (uint32_t)bvh->GetOrderCount(), (uint32_t)bvh->GetUnboundedCount() }, sizeof(BVHNode) };
+			Write(header, bvh->GetNodes(), sizeof(BVHNode), bvh->GetOrder(), bvh->GetUnbounded());
+		}
+		return bvh;
+	}
+};
@@ -0,0 +1,248 @@
+#pragma once
+#include <list>
+#include <vector>
+#include <algorithm>
+#include "Shape.h"
+#include "Stats.h"
+using std::list;
+using std::vector;
+
+#define BVH_LEAF_SIZE 2		//叶节点最多包含的entity数
+#define BVH_BIN_NUM 16		//SAH分桶数
+#define BVH_MAX_DEPTH 64	//同时也是遍历栈的大小
+
+struct BVHNode
+{
+	Bound bound;
+	int first;		//叶节点：第一个entity在m_order中的位置；内部节点：右子节点编号(左子节点紧跟在后)
+	int count;		//叶节点的entity数，内部节点为0
+};
+
+//按面积(周长)启发式构建的层次包围盒，节点连续存放，只用编号引用entity，可以直接保存到文件再映射回来
+template<typename T> class BVH
+{
+protected:
+	typedef BVHNode Node;
+	struct Item
+	{
+		int index;		//entity编号
+		Bound bound;
+		Point center;
+	};
+	//节点和编号数组指向自己生成的vector，或者指向映射的缓存文件
+	const Node* m_nodes;
+	const int* m_order;			//叶节点中的entity编号
+	const int* m_unbounded;		//无界的entity(如半平面)，每条射线都要测试
+	int m_node_count, m_order_count, m_unbounded_count;
+	vector<Node> m_node_storage;
+	vector<int> m_order_storage, m_unbounded_storage;
+	vector<Item> m_items;		//只在构建时使用
+	vector<T*> m_data;
+
+	//对m_items[begin, end)建立子树，返回节点编号
+	int Build(int begin, int end, int depth)
+	{
+		int index = (int)m_node_storage.size();
+		m_node_storage.push_back(Node());
+		Bound bound, center_bound;
+		bound.Reset();
+		center_bound.Reset();
+		for (int i = begin; i < end; i++)
+		{
+			bound.Expand(m_items[i].bound);
+			center_bound.Expand({ m_items[i].center.x, m_items[i].center.x, m_items[i].center.y, m_items[i].center.y });
+		}
+		m_node_storage[index].bound = bound;
+		int count = end - begin;
+		int axis, split;
+		if (count <= BVH_LEAF_SIZE || depth >= BVH_MAX_DEPTH - 1 || !FindSplit(begin, end, center_bound, bound, axis, split))
+		{
+			m_node_storage[index].first = begin;
+			m_node_storage[index].count = count;
+			return index;
+		}
+		//按分桶结果划分
+		float lo = axis == 0 ? center_bound.left : center_bound.up;
+		float hi = axis == 0 ? center_bound.right : center_bound.down;
+		Item* mid = std::partition(&m_items[begin], &m_items[begin] + count, [&](const Item& item)
+		{
+			return GetBin(axis == 0 ? item.center.x : item.center.y, lo, hi) < split;
+		});
+		int middle = (int)(mid - &m_items[0]);
+		if (middle == begin || middle == end)
+			middle = (begin + end) / 2;
+		Build(begin, middle, depth + 1);
+		int right = Build(middle, end, depth + 1);
+		m_node_storage[index].first = right;
+		m_node_storage[index].count = 0;
+		return index;
+	}
+	static int GetBin(float c, float lo, float hi)
+	{
+		int bin = (int)((c - lo) / (hi - lo) * BVH_BIN_NUM);
+		return std::min(std::max(bin, 0), BVH_BIN_NUM - 1);
+	}
+	//在两个轴上分桶，寻找代价最小的划分，划分不如不分时返回false
+	bool FindSplit(int begin, int end, Bound center_bound, Bound bound, int& best_axis, int& best_split)
+	{
+		float best_cost = (end - begin) * bound.Perimeter();
+		bool found = false;
+		for (int axis = 0; axis < 2; axis++)
+		{
+			float lo = axis == 0 ? center_bound.left : center_bound.up;
+			float hi = axis == 0 ? center_bound.right : center_bound.down;
+			if (hi - lo <= 0.f) continue;
+			Bound bins[BVH_BIN_NUM];
+			int counts[BVH_BIN_NUM] = { 0 };
+			for (int i = 0; i < BVH_BIN_NUM; i++)
+				bins[i].Reset();
+			for (int i = begin; i < end; i++)
+			{
+				int bin = GetBin(axis == 0 ? m_items[i].center.x : m_items[i].center.y, lo, hi);
+				bins[bin].Expand(m_items[i].bound);
+				counts[bin]++;
+			}
+			//从右向左累计右半部分
+			float right_cost[BVH_BIN_NUM];
+			Bound acc;
+			acc.Reset();
+			int acc_count = 0;
+			for (int i = BVH_BIN_NUM - 1; i > 0; i--)
+			{
+				acc.Expand(bins[i]);
+				acc_count += counts[i];
+				right_cost[i] = acc_count * acc.Perimeter();
+			}
+			acc.Reset();
+			acc_count = 0;
+			for (int i = 1; i < BVH_BIN_NUM; i++)
+			{
+				acc.Expand(bins[i - 1]);
+				acc_count += counts[i - 1];
+				float cost = acc_count * acc.Perimeter() + right_cost[i];
+				if (cost < best_cost)
+				{
+					best_cost = cost;
+					best_axis = axis;
+					best_split = i;
+					found = true;
+				}
+			}
+		}
+		return found;
+	}
+	void IntersectItem(T* data, Point p, Vector d, T* &ent, Point& inter, Vector& normal, float& dist)
+	{
+		Point tmp_inter;
+		Vector tmp_normal;
+		if (data->Intersect(p, d, tmp_inter, tmp_normal))
+		{
+			float tmp_dist = (tmp_inter - p).len();
+			if (dist > tmp_dist)
+			{
+				ent = data;
+				dist = tmp_dist;
+				inter = tmp_inter;
+				normal = tmp_normal;
+			}
+		}
+	}
+public:
+	BVH(list<T*> data) : m_data(data.begin(), data.end())
+	{
+		for (int i = 0; i < (int)m_data.size(); i++)
+		{
+			Bound b;
+			if (m_data[i]->GetBound(b.left, b.right, b.up, b.down))
+			{
+				//稍微放大，避免交点恰好落在包围盒边界上
+				b.left -= EPSILON, b.right += EPSILON, b.up -= EPSILON, b.down += EPSILON;
+				m_items.push_back({ i, b, { (b.left + b.right) / 2.f, (b.up + b.down) / 2.f } });
+			}
+			else
+				m_unbounded_storage.push_back(i);
+		}
+		if (!m_items.empty())
+			Build(0, (int)m_items.size(), 0);
+		for (auto& item : m_items)
+			m_order_storage.push_back(item.index);
+		vector<Item>().swap(m_items);
+		m_nodes = m_node_storage.data();
+		m_order = m_order_storage.data();
+		m_unbounded = m_unbounded_storage.data();
+		m_node_count = (int)m_node_storage.size();
+		m_order_count = (int)m_order_storage.size();
+		m_unbounded_count = (int)m_unbounded_storage.size();
+	}
+	//使用已生成的节点(如映射的缓存文件)，数组由调用者保证在BVH销毁前有效且已检查过
+	BVH(list<T*> data, const Node* nodes, int node_count, const int* order, int order_count, const int* unbounded, int unbounded_count) :
+		m_nodes(nodes), m_order(order), m_unbounded(unbounded),
+		m_node_count(node_count), m_order_count(order_count), m_unbounded_count(unbounded_count), m_data(data.begin(), data.end()) {}
+	int GetNodeCount() { return m_node_count; }
+	const Node* GetNodes() { return m_nodes; }
+	const int* GetOrder() { return m_order; }
+	int GetOrderCount() { return m_order_count; }
+	const int* GetUnbounded() { return m_unbounded; }
+	int GetUnboundedCount() { return m_unbounded_count; }
+	//节点和entity编号占用的内存(字节)，映射的节点也计算在内
+	size_t GetMemoryUsage()
+	{
+		return m_node_count * sizeof(Node) + (m_order_count + m_unbounded_count) * sizeof(int) + m_data.size() * sizeof(T*);
+	}
+	//返回射线相交的最近entity、交点和交点处的法向，从近到远遍历，跳过比当前最近交点更远的节点
+	void Intersect(Point p, Vector d, T* &ent, Point &inter, Vector &normal)
+	{
+		float dist = 10.f;
+		for (int i = 0; i < m_unbounded_count; i++)
+			IntersectItem(m_data[m_unbounded[i]], p, d, ent, inter, normal, dist);
+		if (m_node_count == 0) return;
+		Vector inv_d = { 1.f / d.x, 1.f / d.y };
+		int stack[BVH_MAX_DEPTH];
+		float stack_dist[BVH_MAX_DEPTH];		//节点入栈时的进入距离
+		int top = 0;
+		float t_near;
+		if (!m_nodes[0].bound.Intersect(p, inv_d, dist, t_near)) return;
+		stack[top] = 0;
+		stack_dist[top++] = t_near;
+		while (top > 0)
+		{
+			top--;
+			if (stack_dist[top] > dist) continue;	//入栈后找到了更近的交点
+			const Node& node = m_nodes[stack[top]];
+			STAT_ADD(nodes, 1);
+			if (node.count > 0)
+			{
+				for (int i = node.first; i < node.first + node.count; i++)
+					IntersectItem(m_data[m_order[i]], p, d, ent, inter, normal, dist);
+				continue;
+			}
+			int left = (int)(&node - &m_nodes[0]) + 1, right = node.first;
+			float t_left, t_right;
+			bool hit_left = m_nodes[left].bound.Intersect(p, inv_d, dist, t_left);
+			bool hit_right = m_nodes[right].bound.Intersect(p, inv_d, dist, t_right);
+			//远的先入栈，近的先出栈
+			if (hit_left && hit_right)
+			{
+				if (t_left < t_right)
+				{
+					std::swap(left, right);
+					std::swap(t_left, t_right);
+				}
+				stack[top] = left;
+				stack_dist[top++] = t_left;
+				stack[top] = right;
+				stack_dist[top++] = t_right;
+			}
+			else if (hit_left)
+			{
+				stack[top] = left;
+				stack_dist[top++] = t_left;
+			}
+			else if (hit_right)
+			{
+				stack[top] = right;
+				stack_dist[top++] = t_right;
+			}
+		}
+	}
+};
@@ -0,0 +1,308 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include "Simd.h"
+#include "Scene.h"
+#include "FrameBuffer.h"
+#include "ThreadPool.h"
+#include "Trace.h"
+
+#define DENOISE_ITERATIONS 5		//a-trous的轮数，第i轮的采样间隔为2^i
+#define DENOISE_SIGMA_COLOR 0.5f	//颜色差按中心亮度归一化后的容差，每轮减半
+#define DENOISE_SIGMA_DIST 0.05f	//首次相交距离的容差
+#define DENOISE_SIGMA_BASE 0.1f		//自发光亮度的容差
+#define DENOISE_GUIDE_DIRS 8		//计算首次相交距离时的射线数
+#define DENOISE_BAND 16				//每个任务处理的行数
+
+//降噪器的一行数据：颜色和导向缓冲区都按平面存储，便于SIMD按x连续处理
+struct DenoiseRow
+{
+	const float *r, *g, *b;
+	const float *lum;					//预先模糊过的亮度，颜色项的权重按它计算，不受单个像素噪声的影响
+	const float *id, *base, *dist;		//entity编号(没有为-1)、自发光亮度、首次相交距离
+};
+
+struct DenoiseAcc
+{
+	float *r, *g, *b, *w;
+};
+
+//以下为一个滤波核抽头的内核：对[begin, n)的每个像素，按导向缓冲区和颜色的差计算邻居n的权重并累加
+//不同entity之间权重为0，其余为h / (1 + 各项差的平方 / 容差的平方)，亮度项的系数ic按中心像素预先算好
+//SIMD内核返回已经处理到的位置，剩余不足一组的像素由标量内核处理
+inline void DenoiseTapScalar(const DenoiseRow& c, const DenoiseRow& nb, const float* ic, float h, float inv_dist, float inv_base, int begin, int n, DenoiseAcc acc)
+{
+	for (int i = begin; i < n; i++)
+	{
+		float dl = nb.lum[i] - c.lum[i], dd = nb.dist[i] - c.dist[i], de = nb.base[i] - c.base[i];
+		float w = h / (1.f + dl * dl * ic[i] + dd * dd * inv_dist + de * de * inv_base);
+		w = nb.id[i] == c.id[i] ? w : 0.f;
+		acc.r[i] += w * nb.r[i];
+		acc.g[i] += w * nb.g[i];
+		acc.b[i] += w * nb.b[i];
+		acc.w[i] += w;
+	}
+}
+
+#if SIMD_X86
+SIMD_TARGET("sse2")
+inline int DenoiseTapSSE(const DenoiseRow& c, const DenoiseRow& nb, const float* ic, float h, float inv_dist, float inv_base, int begin, int n, DenoiseAcc acc)
+{
+	__m128 vh = _mm_set1_ps(h), vid = _mm_set1_ps(inv_dist), vib = _mm_set1_ps(inv_base), one = _mm_set1_ps(1.f);
+	int i = begin;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 nr = _mm_loadu_ps(nb.r + i), ng = _mm_loadu_ps(nb.g + i), nbb = _mm_loadu_ps(nb.b + i);
+		__m128 dl = _mm_sub_ps(_mm_loadu_ps(nb.lum + i), _mm_loadu_ps(c.lum + i));
+		__m128 dd = _mm_sub_ps(_mm_loadu_ps(nb.dist + i), _mm_loadu_ps(c.dist + i));
+		__m128 de = _mm_sub_ps(_mm_loadu_ps(nb.base + i), _mm_loadu_ps(c.base + i));
+		__m128 den = _mm_add_ps(_mm_add_ps(one, _mm_mul_ps(_mm_mul_ps(dl, dl), _mm_loadu_ps(ic + i))),
+			_mm_add_ps(_mm_mul_ps(_mm_mul_ps(dd, dd), vid), _mm_mul_ps(_mm_mul_ps(de, de), vib)));
+		__m128 w = _mm_and_ps(_mm_cmpeq_ps(_mm_loadu_ps(nb.id + i), _mm_loadu_ps(c.id + i)), _mm_div_ps(vh, den));
+		_mm_storeu_ps(acc.r + i, _mm_add_ps(_mm_loadu_ps(acc.r + i), _mm_mul_ps(w, nr)));
+		_mm_storeu_ps(acc.g + i, _mm_add_ps(_mm_loadu_ps(acc.g + i), _mm_mul_ps(w, ng)));
+		_mm_storeu_ps(acc.b + i, _mm_add_ps(_mm_loadu_ps(acc.b + i), _mm_mul_ps(w, nbb)));
+		_mm_storeu_ps(acc.w + i, _mm_add_ps(_mm_loadu_ps(acc.w + i), w));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx2")
+inline int DenoiseTapAVX2(const DenoiseRow& c, const DenoiseRow& nb, const float* ic, float h, float inv_dist, float inv_base, int begin, int n, DenoiseAcc acc)
+{
+	__m256 vh = _mm256_set1_ps(h), vid = _mm256_set1_ps(inv_dist), vib = _mm256_set1_ps(inv_base), one = _mm256_set1_ps(1.f);
+	int i = begin;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 nr = _mm256_loadu_ps(nb.r + i), ng = _mm256_loadu_ps(nb.g + i), nbb = _mm256_loadu_ps(nb.b + i);
+		__m256 dl = _mm256_sub_ps(_mm256_loadu_ps(nb.lum + i), _mm256_loadu_ps(c.lum + i));
+		__m256 dd = _mm256_sub_ps(_mm256_loadu_ps(nb.dist + i), _mm256_loadu_ps(c.dist + i));
+		__m256 de = _mm256_sub_ps(_mm256_loadu_ps(nb.base + i), _mm256_loadu_ps(c.base + i));
+		__m256 den = _mm256_add_ps(_mm256_add_ps(one, _mm256_mul_ps(_mm256_mul_ps(dl, dl), _mm256_loadu_ps(ic + i))),
+			_mm256_add_ps(_mm256_mul_ps(_mm256_mul_ps(dd, dd), vid), _mm256_mul_ps(_mm256_mul_ps(de, de), vib)));
+		__m256 w = _mm256_and_ps(_mm256_cmp_ps(_mm256_loadu_ps(nb.id + i), _mm256_loadu_ps(c.id + i), _CMP_EQ_OQ), _mm256_div_ps(vh, den));
+		_mm256_storeu_ps(acc.r + i, _mm256_add_ps(_mm256_loadu_ps(acc.r + i), _mm256_mul_ps(w, nr)));
+		_mm256_storeu_ps(acc.g + i, _mm256_add_ps(_mm256_loadu_ps(acc.g + i), _mm256_mul_ps(w, ng)));
+		_mm256_storeu_ps(acc.b + i, _mm256_add_ps(_mm256_loadu_ps(acc.b + i), _mm256_mul_ps(w, nbb)));
+		_mm256_storeu_ps(acc.w + i, _mm256_add_ps(_mm256_loadu_ps(acc.w + i), w));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx512f")
+inline int DenoiseTapAVX512(const DenoiseRow& c, const DenoiseRow& nb, const float* ic, float h, float inv_dist, float inv_base, int begin, int n, DenoiseAcc acc)
+{
+	__m512 vh = _mm512_set1_ps(h), vid = _mm512_set1_ps(inv_dist), vib = _mm512_set1_ps(inv_base), one = _mm512_set1_ps(1.f);
+	int i = begin;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512 nr = _mm512_loadu_ps(nb.r + i), ng = _mm512_loadu_ps(nb.g + i), nbb = _mm512_loadu_ps(nb.b + i);
+		__m512 dl = _mm512_sub_ps(_mm512_loadu_ps(nb.lum + i), _mm512_loadu_ps(c.lum + i));
+		__m512 dd = _mm512_sub_ps(_mm512_loadu_ps(nb.dist + i), _mm512_loadu_ps(c.dist + i));
+		__m512 de = _mm512_sub_ps(_mm512_loadu_ps(nb.base + i), _mm512_loadu_ps(c.base + i));
+		__m512 den = _mm512_add_ps(_mm512_add_ps(one, _mm512_mul_ps(_mm512_mul_ps(dl, dl), _mm512_loadu_ps(ic + i))),
+			_mm512_add_ps(_mm512_mul_ps(_mm512_mul_ps(dd, dd), vid), _mm512_mul_ps(_mm512_mul_ps(de, de), vib)));
+		__mmask16 same = _mm512_cmp_ps_mask(_mm512_loadu_ps(nb.id + i), _mm512_loadu_ps(c.id + i), _CMP_EQ_OQ);
+		__m512 w = _mm512_maskz_mov_ps(same, _mm512_div_ps(vh, den));
+		_mm512_storeu_ps(acc.r + i, _mm512_add_ps(_mm512_loadu_ps(acc.r + i), _mm512_mul_ps(w, nr)));
+		_mm512_storeu_ps(acc.g + i, _mm512_add_ps(_mm512_loadu_ps(acc.g + i), _mm512_mul_ps(w, ng)));
+		_mm512_storeu_ps(acc.b + i, _mm512_add_ps(_mm512_loadu_ps(acc.b + i), _mm512_mul_ps(w, nbb)));
+		_mm512_storeu_ps(acc.w + i, _mm512_add_ps(_mm512_loadu_ps(acc.w + i), w));
+	}
+	return i;
+}
+#endif // SIMD_X86
+
+//根据ActiveSimdLevel()选择内核
+inline void DenoiseTap(const DenoiseRow& c, const DenoiseRow& nb, const float* ic, float h, float inv_dist, float inv_base, int begin, int n, DenoiseAcc acc)
+{
+	int done = begin;
+#if SIMD_X86
+	switch (ActiveSimdLevel())
+	{
+	case SIMD_AVX512: done = DenoiseTapAVX512(c, nb, ic, h, inv_dist, inv_base, begin, n, acc); break;
+	case SIMD_AVX2: done = DenoiseTapAVX2(c, nb, ic, h, inv_dist, inv_base, begin, n, acc); break;
+	case SIMD_SSE: done = DenoiseTapSSE(c, nb, ic, h, inv_dist, inv_base, begin, n, acc); break;
+	default: break;
+	}
+#endif
+	DenoiseTapScalar(c, nb, ic, h, inv_dist, inv_base, done, n, acc);
+}
+
+//边缘保持的a-trous降噪：用entity编号、自发光和首次相交距离作为导向，滤波不会越过entity的边界
+class Denoiser
+{
+protected:
+	ThreadPool* m_pool;
+	int m_width, m_height;
+	std::vector<float> m_id, m_base, m_dist;	//导向缓冲区
+	std::vector<float> m_color[2][3];			//两组颜色平面轮流作为输入和输出
+	std::vector<float> m_lum, m_smooth;			//本轮输入的亮度和它3x3模糊后的结果
+	std::vector<float> m_ic;					//每个像素颜色项的系数
+	std::vector<float> m_weight;
+	double m_guide_time, m_filter_time;
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+
+	//把[0, height)切成行带交给线程池，func(y0, y1)
+	template<typename Func> void ForBands(Func func)
+	{
+		for (int y = 0; y < m_height; y += DENOISE_BAND)
+		{
+			int y1 = std::min(y + DENOISE_BAND, m_height);
+			m_pool->Submit([func, y, y1]() { func(y, y1); });
+		}
+		m_pool->Wait();
+	}
+	//第y行从第x个像素开始的数据，x必须在[0, m_width)内，指针由data()得到，不经过越界的下标
+	DenoiseRow GetRow(int k, int y, int x)
+	{
+		size_t i = (size_t)y * m_width + x;
+		return { m_color[k][0].data() + i, m_color[k][1].data() + i, m_color[k][2].data() + i, m_smooth.data() + i, m_id.data() + i, m_base.data() + i, m_dist.data() + i };
+	}
+	//第iteration轮：5x5的B3样条核，抽头间隔为2^iteration，从第k组颜色平面滤波到另一组
+	void Iterate(int iteration, int k)
+	{
+		static const float kernel[5] = { 1.f / 16.f, 1.f / 4.f, 3.f / 8.f, 1.f / 4.f, 1.f / 16.f };
+		const int step = 1 << iteration;
+		const float sigma = DENOISE_SIGMA_COLOR;
+		const float inv_dist = 1.f / (DENOISE_SIGMA_DIST * DENOISE_SIGMA_DIST);
+		const float inv_base = 1.f / (DENOISE_SIGMA_BASE * DENOISE_SIGMA_BASE);
+		ForBands([this, k](int y0, int y1)
+		{
+			for (size_t i = (size_t)y0 * m_width; i < (size_t)y1 * m_width; i++)
+				m_lum[i] = (m_color[k][0][i] + m_color[k][1][i] + m_color[k][2][i]) / 3.f;
+		});
+		//亮度在同一entity内做3x3(间隔step)的平均
+		ForBands([this, step](int y0, int y1)
+		{
+			const int w = m_width;
+			for (int y = y0; y < y1; y++)
+				for (int x = 0; x < w; x++)
+				{
+					size_t i = (size_t)y * w + x;
+					float l = 0.f;
+					int count = 0;
+					for (int ny = std::max(y - step, 0); ny <= std::min(y + step, m_height - 1); ny += step)
+						for (int nx = std::max(x - step, 0); nx <= std::min(x + step, w - 1); nx += step)
+						{
+							size_t j = (size_t)ny * w + nx;
+							if (m_id[j] != m_id[i]) continue;
+							l += m_lum[j];
+							count++;
+						}
+					m_smooth[i] = l / count;
+				}
+		});
+		ForBands([this, k, step, sigma, inv_dist, inv_base](int y0, int y1)
+		{
+			TraceScope trace("denoise", 0, y0);
+			const int w = m_width;
+			for (int y = y0; y < y1; y++)
+			{
+				size_t row = (size_t)y * w;
+				float* ic = &m_ic[row];
+				//亮度差按中心的亮度归一化
+				for (int x = 0; x < w; x++)
+					ic[x] = 1.f / (sigma * sigma * (m_smooth[row + x] * m_smooth[row + x] + 1e-4f));
+				DenoiseAcc acc = { &m_color[1 - k][0][row], &m_color[1 - k][1][row], &m_color[1 - k][2][row], &m_weight[row] };
+				std::fill(acc.r, acc.r + w, 0.f);
+				std::fill(acc.g, acc.g + w, 0.f);
+				std::fill(acc.b, acc.b + w, 0.f);
+				std::fill(acc.w, acc.w + w, 0.f);
+				for (int ky = 0; ky < 5; ky++)
+				{
+					int ny = y + (ky - 2) * step;
+					if (ny < 0 || ny >= m_height) continue;
+					for (int kx = 0; kx < 5; kx++)
+					{
+						//邻居超出图像的抽头直接跳过，有效的x是连续的一段[begin, end)，各行的指针都从begin开始
+						int off = (kx - 2) * step;
+						int begin = std::max(0, -off), end = std::min(w, w - off);
+						if (begin >= end) continue;
+						DenoiseRow c = GetRow(k, y, begin), nb = GetRow(k, ny, begin + off);
+						DenoiseAcc part = { acc.r + begin, acc.g + begin, acc.b + begin, acc.w + begin };
+						DenoiseTap(c, nb, ic + begin, kernel[ky] * kernel[kx], inv_dist, inv_base, 0, end - begin, part);
+					}
+				}
+				for (int x = 0; x < w; x++)
+				{
+					float inv = 1.f / acc.w[x];		//中心抽头的权重总是大于0
+					acc.r[x] *= inv;
+					acc.g[x] *= inv;
+					acc.b[x] *= inv;
+				}
+			}
+		});
+	}
+public:
+	Denoiser(ThreadPool* pool) : m_pool(pool), m_width(0), m_height(0), m_guide_time(0.0), m_filter_time(0.0) {}
+	//按像素位置计算导向缓冲区，与Sample使用同样的像素坐标
+	void BuildGuides(Scene* s, int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+		m_id.assign(width * height, -1.f);
+		m_base.assign(width * height, 0.f);
+		m_dist.assign(width * height, 0.f);
+		TraceScope trace("denoise guides");
+		double start = Now();
+		ForBands([this, s](int y0, int y1)
+		{
+			for (int y = y0; y < y1; y++)
+				for (int x = 0; x < m_width; x++)
+				{
+					int id;
+					Color base;
+					float dist;
+					s->GetGuide({ (float)x / m_width, (float)y / m_height }, DENOISE_GUIDE_DIRS, id, base, dist);
+					size_t i = (size_t)y * m_width + x;
+					m_id[i] = (float)id;
+					m_base[i] = base.r + base.g + base.b;
+					m_dist[i] = dist;
+				}
+		});
+		m_guide_time = Now() - start;
+	}
+	//对fb中的平均颜色做iterations轮滤波，结果写回fb，每个像素的采样次数不变
+	void Filter(FrameBuffer& fb, int iterations = DENOISE_ITERATIONS)
+	{
+		if (fb.GetWidth() != m_width || fb.GetHeight() != m_height) return;
+		TraceScope trace("denoise");
+		double start = Now();
+		size_t n = (size_t)m_width * m_height;
+		for (int k = 0; k < 2; k++)
+			for (int c = 0; c < 3; c++)
+				m_color[k][c].resize(n);
+		m_lum.resize(n);
+		m_smooth.resize(n);
+		m_ic.resize(n);
+		m_weight.resize(n);
+		for (int y = 0; y < m_height; y++)
+			for (int x = 0; x < m_width; x++)
+			{
+				Color c = fb.Get(x, y);
+				size_t i = (size_t)y * m_width + x;
+				m_color[0][0][i] = c.r, m_color[0][1][i] = c.g, m_color[0][2][i] = c.b;
+			}
+		int k = 0;
+		for (int i = 0; i < iterations; i++, k = 1 - k)
+			Iterate(i, k);
+		for (int y = 0; y < m_height; y++)
+			for (int x = 0; x < m_width; x++)
+			{
+				size_t i = (size_t)y * m_width + x;
+				fb.Set(x, y, { m_color[k][0][i], m_color[k][1][i], m_color[k][2][i] });
+			}
+		m_filter_time = Now() - start;
+	}
+	void PrintStats(std::ostream& out)
+	{
+		out << "denoise: guides " << m_guide_time << "s, filter " << m_filter_time << "s (" << GetSimdName(ActiveSimdLevel()) << ")" << std::endl;
+	}
+};
@@ -0,0 +1,585 @@
+// 分布式tile渲染：协调进程把图像切成tile任务，通过TCP发给若干worker进程(本机或其他机器)，
+// worker渲染后把浮点的颜色和与采样次数发回，协调进程累加到FrameBuffer；worker断开时它未完成的tile重新分配
+#pragma once
+#include <stdint.h>
+#include <string.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <deque>
+#include <iostream>
+#include <functional>
+#include <chrono>
+#include <thread>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <process.h>
+#pragma comment(lib, "ws2_32.lib")
+typedef SOCKET socket_t;
+#else
+#include <sys/socket.h>
+#include <sys/select.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <unistd.h>
+#include <signal.h>
+typedef int socket_t;
+#define INVALID_SOCKET (-1)
+#endif
+#include "FrameBuffer.h"
+#include "Renderer.h"
+#include "Trace.h"
+
+#define DIST_MAGIC 0x54534944u	//"DIST"
+#define DIST_VERSION 1
+#define DIST_TILE_SIZE 128		//分发给worker的tile大小，是TILE_SIZE的倍数，worker内部再切成TILE_SIZE的tile交给线程池
+#define DIST_QUEUE_DEPTH 2		//每个worker同时分配的tile数，渲染当前tile时下一个已经在传输中
+#define DIST_TIMEOUT 10			//worker连接的重试秒数；协调进程没有可用的worker这么久后自己渲染剩余的tile，连接后这么久没发完hello的也断开
+#define DIST_STALL_TIMEOUT 30	//worker的当前任务这么久没有交回就视为失联，断开并重新分配它的任务
+#define DIST_STALL_FACTOR 4		//超时至少是已完成任务最长耗时的这个倍数，避免慢的tile被误判
+
+//消息都是定长的整数，worker与协调进程需要字节序相同
+struct DistHello
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t config;		//渲染参数的指纹，不一致的worker会被拒绝
+	int32_t threads;
+};
+
+//x0 < 0表示没有更多任务，worker退出
+struct DistJob
+{
+	int32_t id;
+	int32_t x0, y0, x1, y1;
+	uint32_t seed;
+};
+
+//结果：DistResultHeader之后是tile内逐行的DistPixel
+struct DistResultHeader
+{
+	int32_t id;
+	int32_t pixels;
+};
+
+struct DistPixel
+{
+	float r, g, b;		//颜色之和
+	int32_t count;		//采样次数
+};
+
+//渲染一个tile，fb的大小与tile相同，像素(x, y)对应图像中的(tile.x0 + x, tile.y0 + y)
+typedef std::function<void(FrameBuffer& fb, const Tile& tile, unsigned int seed)> TileRenderFunc;
+
+//跨平台的阻塞socket操作
+class DistSocket
+{
+public:
+	static void Startup()
+	{
+#ifdef _WIN32
+		static bool started = false;
+		if (!started)
+		{
+			WSADATA data;
+			WSAStartup(MAKEWORD(2, 2), &data);
+			started = true;
+		}
+#else
+		signal(SIGPIPE, SIG_IGN);		//对端退出后写入返回错误，而不是结束进程
+#endif
+	}
+	static void Close(socket_t s)
+	{
+#ifdef _WIN32
+		closesocket(s);
+#else
+		close(s);
+#endif
+	}
+	//关闭两个方向的传输，其他线程中阻塞在s上的recv立即返回
+	static void Shutdown(socket_t s)
+	{
+#ifdef _WIN32
+		shutdown(s, SD_BOTH);
+#else
+		shutdown(s, SHUT_RDWR);
+#endif
+	}
+	static bool SendAll(socket_t s, const void* data, size_t size)
+	{
+		const char* p = (const char*)data;
+		while (size > 0)
+		{
+			int n = send(s, p, (int)std::min(size, (size_t)1 << 20), 0);
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	static bool RecvAll(socket_t s, void* data, size_t size)
+	{
+		char* p = (char*)data;
+		while (size > 0)
+		{
+			int n = recv(s, p, (int)std::min(size, (size_t)1 << 20), 0);
+			if (n <= 0) return false;
+			p += n;
+			size -= n;
+		}
+		return true;
+	}
+	static void NoDelay(socket_t s)
+	{
+		int one = 1;
+		setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+	}
+	//读到换行为止，不含换行符；连接断开时返回false
+	static bool RecvLine(socket_t s, std::string& line)
+	{
+		line.clear();
+		char c;
+		while (recv(s, &c, 1, 0) == 1)
+		{
+			if (c == '\n')
+				return true;
+			if (c != '\r')
+				line += c;
+		}
+		return false;
+	}
+	//在address(如127.0.0.1，0.0.0.0表示所有网卡)的port上监听，0表示由系统选择端口，实际端口写回port
+	static socket_t Listen(int& port, const std::string& address = "127.0.0.1")
+	{
+		socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+		if (s == INVALID_SOCKET) return INVALID_SOCKET;
+		int one = 1;
+		setsockopt(s, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+		sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons((unsigned short)port);
+		socklen_t len = sizeof(addr);
+		if (inet_pton(AF_INET, address.c_str(), &addr.sin_addr) != 1 || bind(s, (sockaddr*)&addr, sizeof(addr)) != 0 || listen(s, 64) != 0
+			|| getsockname(s, (sockaddr*)&addr, &len) != 0)
+		{
+			Close(s);
+			return INVALID_SOCKET;
+		}
+		port = ntohs(addr.sin_port);
+		return s;
+	}
+	//接受一个连接，name为对端的ip:port
+	static socket_t Accept(socket_t listener, std::string& name)
+	{
+		sockaddr_in addr;
+		socklen_t len = sizeof(addr);
+		socket_t s = accept(listener, (sockaddr*)&addr, &len);
+		if (s == INVALID_SOCKET) return INVALID_SOCKET;
+		NoDelay(s);
+		name = std::string(inet_ntoa(addr.sin_addr)) + ":" + std::to_string(ntohs(addr.sin_port));
+		return s;
+	}
+	//等待s可读，最多seconds秒
+	static bool WaitReadable(socket_t s, int seconds)
+	{
+		fd_set readable;
+		FD_ZERO(&readable);
+		FD_SET(s, &readable);
+		timeval timeout = { seconds, 0 };
+		return select((int)s + 1, &readable, NULL, NULL, &timeout) > 0;
+	}
+	//address为host:port
+	static socket_t Connect(const std::string& address)
+	{
+		size_t colon = address.rfind(':');
+		if (colon == std::string::npos) return INVALID_SOCKET;
+		std::string host = address.substr(0, colon), port = address.substr(colon + 1);
+		addrinfo hints, *result = NULL;
+		memset(&hints, 0, sizeof(hints));
+		hints.ai_family = AF_INET;
+		hints.ai_socktype = SOCK_STREAM;
+		if (getaddrinfo(host.c_str(), port.c_str(), &hints, &result) != 0) return INVALID_SOCKET;
+		socket_t s = socket(AF_INET, SOCK_STREAM, 0);
+		if (s != INVALID_SOCKET && connect(s, result->ai_addr, (int)result->ai_addrlen) != 0)
+		{
+			Close(s);
+			s = INVALID_SOCKET;
+		}
+		freeaddrinfo(result);
+		if (s != INVALID_SOCKET)
+			NoDelay(s);
+		return s;
+	}
+};
+
+//协调进程：监听端口，接受worker连接，按需分配tile并合并结果
+class TileCoordinator
+{
+protected:
+	struct Worker
+	{
+		socket_t sock;
+		bool ready;				//已收到并验证了DistHello
+		int threads;
+		std::deque<int> jobs;	//已分配未完成的任务，worker按顺序处理
+		int tiles;				//完成的任务数
+		std::string name;
+		std::vector<char> inbox;	//当前消息已经收到的部分
+		double busy_since;		//连接或开始当前任务的时间，用于判断超时
+	};
+	socket_t m_listen;
+	int m_port;
+	uint32_t m_config;
+	std::vector<Worker> m_workers;
+	std::vector<intptr_t> m_children;	//Spawn启动的本机worker进程
+	std::vector<int> m_finished;		//已断开的worker完成的任务数，用于统计
+	TileRenderFunc m_local;
+	std::function<void(const Tile&)> m_on_tile;
+	std::vector<DistJob> m_jobs;
+	std::deque<int> m_pending;		//未分配的任务
+	std::vector<int> m_remaining;	//每个tile还未合并的轮数
+	std::vector<DistPixel> m_buffer;
+	int m_passes, m_reassigned, m_local_tiles;
+	double m_tile_time;		//worker完成一个任务的最长耗时
+	double m_wall_time;
+	long long m_pixels;
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	int LiveWorkers()
+	{
+		int n = 0;
+		for (auto& w : m_workers)
+			n += w.ready;
+		return n;
+	}
+	//断开worker，把它未完成的任务放回队首优先重新分配
+	void Drop(size_t i, const char* reason)
+	{
+		Worker& w = m_workers[i];
+		if (!w.jobs.empty() || w.ready)
+			std::cerr << "worker " << w.name << " " << reason << ", reassigning " << w.jobs.size() << " tiles" << std::endl;
+		m_reassigned += (int)w.jobs.size();
+		for (auto it = w.jobs.rbegin(); it != w.jobs.rend(); ++it)
+			m_pending.push_front(*it);
+		m_finished.push_back(w.tiles);
+		DistSocket::Close(w.sock);
+		m_workers.erase(m_workers.begin() + i);
+	}
+	void Merge(FrameBuffer& fb, int id, const DistPixel* data)
+	{
+		const DistJob& job = m_jobs[id];
+		int tw = job.x1 - job.x0, count = tw * (job.y1 - job.y0);
+		for (int i = 0; i < count; i++)
+			fb.Add(job.x0 + i % tw, job.y0 + i / tw, { data[i].r, data[i].g, data[i].b }, data[i].count);
+		m_pixels += count;
+		if (--m_remaining[id / m_passes] == 0 && m_on_tile)
+			m_on_tile({ job.x0, job.y0, job.x1, job.y1 });
+	}
+	//worker可读时调用一次recv，把到达的数据追加到w.inbox，不等待消息的其余部分，这样停在半条消息的worker不会阻塞协调进程
+	//消息完整后再处理，返回false表示该worker应被断开
+	bool Receive(FrameBuffer& fb, Worker& w, int& done)
+	{
+		size_t need = w.ready ? sizeof(DistResultHeader) : sizeof(DistHello);
+		DistResultHeader header = { -1, 0 };
+		if (w.ready && w.inbox.size() >= sizeof(header))
+		{
+			memcpy(&header, w.inbox.data(), sizeof(header));
+			if (w.jobs.empty() || header.id != w.jobs.front())
+				return false;
+			const DistJob& job = m_jobs[header.id];
+			if (header.pixels != (job.x1 - job.x0) * (job.y1 - job.y0))
+				return false;
+			need += header.pixels * sizeof(DistPixel);
+		}
+		size_t have = w.inbox.size();
+		w.inbox.resize(need);
+		int n = recv(w.sock, w.inbox.data() + have, (int)std::min(need - have, (size_t)1 << 20), 0);
+		if (n <= 0) return false;
+		w.inbox.resize(have + n);
+		//结果头刚收完时还不知道整条消息的长度，下次可读时再继续
+		if (w.inbox.size() < need || (w.ready && header.id < 0))
+			return true;
+		if (!w.ready)
+		{
+			DistHello hello;
+			memcpy(&hello, w.inbox.data(), sizeof(hello));
+			w.inbox.clear();
+			if (hello.magic != DIST_MAGIC || hello.version != DIST_VERSION || hello.config != m_config)
+			{
+				std::cerr << "worker " << w.name << " has different settings" << std::endl;
+				return false;
+			}
+			w.ready = true;
+			w.threads = hello.threads;
+			return true;
+		}
+		//完整收下后再合并，中途断开的结果整个丢弃
+		const DistJob& job = m_jobs[header.id];
+		m_buffer.resize(header.pixels);
+		memcpy(m_buffer.data(), w.inbox.data() + sizeof(header), m_buffer.size() * sizeof(DistPixel));
+		w.inbox.clear();
+		TraceScope trace("merge", job.x0, job.y0);
+		Merge(fb, header.id, m_buffer.data());
+		w.jobs.pop_front();
+		w.tiles++;
+		done++;
+		double now = Now();
+		m_tile_time = std::max(m_tile_time, now - w.busy_since);
+		w.busy_since = now;		//worker接着渲染队列中的下一个任务
+		return true;
+	}
+	//断开连接后迟迟不发完hello的连接和当前任务超时的worker，后者的任务放回队列
+	void DropStalled()
+	{
+		double now = Now(), limit = std::max((double)DIST_STALL_TIMEOUT, DIST_STALL_FACTOR * m_tile_time);
+		for (size_t i = 0; i < m_workers.size(); i++)
+		{
+			Worker& w = m_workers[i];
+			if (!w.ready && now - w.busy_since > DIST_TIMEOUT)
+				Drop(i--, "sent no hello");
+			else if (w.ready && !w.jobs.empty() && now - w.busy_since > limit)
+				Drop(i--, "stalled");
+		}
+	}
+	//没有可用的worker时在本进程内渲染剩余的任务
+	void RenderLocal(FrameBuffer& fb, int& done)
+	{
+		std::cerr << "no workers for " << DIST_TIMEOUT << "s, rendering " << m_pending.size() << " tiles locally" << std::endl;
+		while (!m_pending.empty())
+		{
+			const DistJob& job = m_jobs[m_pending.front()];
+			int tw = job.x1 - job.x0, th = job.y1 - job.y0;
+			FrameBuffer tile_fb(tw, th);
+			m_local(tile_fb, { job.x0, job.y0, job.x1, job.y1 }, job.seed);
+			Pack(tile_fb, m_buffer);
+			Merge(fb, m_pending.front(), m_buffer.data());
+			m_pending.pop_front();
+			m_local_tiles++;
+			done++;
+		}
+	}
+	void Shutdown()
+	{
+		DistJob quit = { -1, -1, -1, -1, -1, 0 };
+		for (auto& w : m_workers)
+		{
+			DistSocket::SendAll(w.sock, &quit, sizeof(quit));
+			DistSocket::Close(w.sock);
+		}
+		m_workers.clear();
+		for (auto child : m_children)
+		{
+#ifdef _WIN32
+			_cwait(NULL, child, 0);
+#else
+			waitpid((pid_t)child, NULL, 0);
+#endif
+		}
+		m_children.clear();
+	}
+public:
+	//config是渲染参数的指纹，local用于没有worker时的本地渲染
+	TileCoordinator(uint32_t config, TileRenderFunc local) :
+		m_listen(INVALID_SOCKET), m_port(0), m_config(config), m_local(local),
+		m_passes(1), m_reassigned(0), m_local_tiles(0), m_tile_time(0.0), m_wall_time(0.0), m_pixels(0)
+	{
+		DistSocket::Startup();
+	}
+	~TileCoordinator()
+	{
+		Shutdown();
+		if (m_listen != INVALID_SOCKET)
+			DistSocket::Close(m_listen);
+	}
+	//在address的port上监听，0表示由系统选择端口；只有本机worker时用127.0.0.1，其他机器的worker连不上
+	bool Listen(int port, const std::string& address = "127.0.0.1")
+	{
+		m_listen = DistSocket::Listen(port, address);
+		m_port = port;
+		return m_listen != INVALID_SOCKET;
+	}
+	int GetPort() { return m_port; }
+	//把tile大小的fb转成传输格式
+	static void Pack(FrameBuffer& fb, std::vector<DistPixel>& data)
+	{
+		int tw = fb.GetWidth(), count = tw * fb.GetHeight();
+		data.resize(count);
+		for (int i = 0; i < count; i++)
+		{
+			Color c = fb.GetSum(i % tw, i / tw);
+			data[i] = { c.r, c.g, c.b, fb.GetCount(i % tw, i / tw) };
+		}
+	}
+	//在本机启动count个worker进程，命令行与协调进程相同，再加上--worker和每个进程的线程数
+	bool Spawn(int argc, char** argv, int count, int threads)
+	{
+		std::string address = "127.0.0.1:" + std::to_string(m_port), thread_arg = std::to_string(threads);
+		std::vector<const char*> args(argv, argv + argc);
+		args.push_back("--worker");
+		args.push_back(address.c_str());
+		args.push_back("--threads");
+		args.push_back(thread_arg.c_str());
+		args.push_back(NULL);
+		for (int i = 0; i < count; i++)
+		{
+#ifdef _WIN32
+			intptr_t child = _spawnv(_P_NOWAIT, argv[0], args.data());
+			if (child == -1) return false;
+#else
+			pid_t child = fork();
+			if (child < 0) return false;
+			if (child == 0)
+			{
+				execvp(argv[0], (char* const*)args.data());
+				_exit(127);
+			}
+#endif
+			m_children.push_back((intptr_t)child);
+		}
+		return true;
+	}
+	//合并后的tile在所有轮次都完成时调用，在协调进程的主线程中
+	void SetTileCallback(std::function<void(const Tile&)> on_tile) { m_on_tile = on_tile; }
+	//每个种子渲染一轮，结果累加到fb；同一tile的各轮连续分配，这样tile能尽早完成
+	//没有调用Listen或监听失败时全部在本进程内渲染
+	void Render(FrameBuffer& fb, const std::vector<unsigned int>& seeds)
+	{
+		TraceScope trace("distributed render");
+		double start = Now();
+		m_passes = (int)seeds.size();
+		m_jobs.clear();
+		m_pending.clear();
+		m_remaining.clear();
+		m_reassigned = m_local_tiles = 0;
+		m_tile_time = 0.0;
+		m_pixels = 0;
+		for (int y = 0; y < fb.GetHeight(); y += DIST_TILE_SIZE)
+			for (int x = 0; x < fb.GetWidth(); x += DIST_TILE_SIZE)
+			{
+				for (int pass = 0; pass < m_passes; pass++)
+				{
+					DistJob job = { (int32_t)m_jobs.size(), x, y, std::min(x + DIST_TILE_SIZE, fb.GetWidth()), std::min(y + DIST_TILE_SIZE, fb.GetHeight()), seeds[pass] };
+					m_pending.push_back(job.id);
+					m_jobs.push_back(job);
+				}
+				m_remaining.push_back(m_passes);
+			}
+		int done = 0, total = (int)m_jobs.size();
+		double last_alive = Now();
+		while (done < total)
+		{
+			for (size_t i = 0; i < m_workers.size(); i++)
+			{
+				Worker& w = m_workers[i];
+				bool ok = true;
+				while (ok && w.ready && (int)w.jobs.size() < DIST_QUEUE_DEPTH && !m_pending.empty())
+				{
+					int id = m_pending.front();
+					m_pending.pop_front();
+					if (w.jobs.empty())
+						w.busy_since = Now();
+					w.jobs.push_back(id);
+					ok = DistSocket::SendAll(w.sock, &m_jobs[id], sizeof(DistJob));
+				}
+				if (!ok)
+					Drop(i--, "disconnected");
+			}
+			DropStalled();
+			if (LiveWorkers() > 0)
+				last_alive = Now();
+			else if ((Now() - last_alive > DIST_TIMEOUT || m_listen == INVALID_SOCKET) && !m_pending.empty())
+			{
+				RenderLocal(fb, done);
+				continue;
+			}
+			fd_set readable;
+			FD_ZERO(&readable);
+			FD_SET(m_listen, &readable);
+			socket_t max_fd = m_listen;
+			for (auto& w : m_workers)
+			{
+				FD_SET(w.sock, &readable);
+				max_fd = std::max(max_fd, w.sock);
+			}
+			timeval timeout = { 1, 0 };
+			if (select((int)max_fd + 1, &readable, NULL, NULL, &timeout) <= 0)
+				continue;
+			if (FD_ISSET(m_listen, &readable))
+			{
+				std::string name;
+				socket_t s = DistSocket::Accept(m_listen, name);
+				if (s != INVALID_SOCKET)
+					m_workers.push_back({ s, false, 0, {}, 0, name, {}, Now() });
+			}
+			for (size_t i = 0; i < m_workers.size(); i++)
+				if (FD_ISSET(m_workers[i].sock, &readable) && !Receive(fb, m_workers[i], done))
+					Drop(i--, "disconnected");
+		}
+		m_wall_time = Now() - start;
+	}
+	void PrintStats(std::ostream& out)
+	{
+		out << "distributed: " << m_workers.size() << " workers, time: " << m_wall_time << "s, " << m_pixels / m_wall_time << " pixels/s";
+		if (m_reassigned)
+			out << ", " << m_reassigned << " tiles reassigned";
+		if (m_local_tiles)
+			out << ", " << m_local_tiles << " tiles rendered locally";
+		out << std::endl;
+		for (auto& w : m_workers)
+			out << "  worker " << w.name << ": " << w.threads << " threads, " << w.tiles << " tiles" << std::endl;
+		for (auto tiles : m_finished)
+			out << "  disconnected worker: " << tiles << " tiles" << std::endl;
+	}
+};
+
+//worker进程：连接协调进程，逐个渲染收到的tile并发回结果，直到收到退出消息或连接断开
+class TileWorker
+{
+public:
+	static bool Run(const std::string& address, uint32_t config, int threads, TileRenderFunc render)
+	{
+		DistSocket::Startup();
+		socket_t s = INVALID_SOCKET;
+		for (int retry = 0; retry < DIST_TIMEOUT * 10 && s == INVALID_SOCKET; retry++)
+		{
+			s = DistSocket::Connect(address);
+			if (s == INVALID_SOCKET)
+				std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		}
+		if (s == INVALID_SOCKET)
+		{
+			std::cerr << "cannot connect to " << address << std::endl;
+			return false;
+		}
+		DistHello hello = { DIST_MAGIC, DIST_VERSION, config, threads };
+		bool ok = DistSocket::SendAll(s, &hello, sizeof(hello));
+		std::vector<DistPixel> data;
+		DistJob job;
+		int tiles = 0;
+		while (ok && DistSocket::RecvAll(s, &job, sizeof(job)) && job.x0 >= 0)
+		{
+			Tile tile = { job.x0, job.y0, job.x1, job.y1 };
+			FrameBuffer fb(tile.x1 - tile.x0, tile.y1 - tile.y0);
+			render(fb, tile, job.seed);
+			TileCoordinator::Pack(fb, data);
+			DistResultHeader header = { job.id, (int32_t)data.size() };
+			ok = DistSocket::SendAll(s, &header, sizeof(header)) && DistSocket::SendAll(s, data.data(), data.size() * sizeof(DistPixel));
+			tiles++;
+		}
+		DistSocket::Close(s);
+		std::cout << "worker: " << tiles << " tiles" << std::endl;
+		return ok;
+	}
+};
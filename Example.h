@@ -1,7 +1,7 @@
 // 部分场景生成实例
 #pragma once
-#include <stdlib.h> // rand(), RAND_MAX
 #include "Scene.h"
+#include "SceneFile.h"
 
 Shape* GeneratePolygon(initializer_list<Point> points);
 
@@ -96,16 +96,149 @@ Scene* GenerateScene7()	//聚光灯
 	return new Scene({ e1 });
 }
 
-Scene* GenerateScene8() //很多星星
+Scene* GenerateScene8(unsigned int seed = 0, int count = 6) //很多星星
 {
 	Circle* c1 = new Circle({ 0.5f, -0.5f }, 0.05f);
 	Entity* e1 = new Entity(c1, { 20.f, 20.f, 20.f });
-	vector<Entity*> stars = { e1 };
+	list<Entity*> stars = { e1 };
+	RandomStream rng(seed);
 	float refract[3] = { 1.4f, 1.5f, 1.6f };
-	for (int i = 0; i < 6; i++)
+	for (int i = 0; i < count; i++)
 	{
-		Circle* c = new Circle({ (float)rand() / RAND_MAX, (float)rand() / RAND_MAX }, (float)rand() / RAND_MAX / 10.f);
+		float x = rng.Next(), y = rng.Next(), r = rng.Next() / 10.f;
+		Circle* c = new Circle({ x, y }, r);
 		stars.push_back(new Entity(c, { 0.f, 0.f, 0.f }, 0.1f, 0.8f, refract));
 	}
 	return new Scene(stars);
 }
+
+//程序生成的大场景参数，用于观察加速结构随entity数增长的表现
+struct LargeSceneParams
+{
+	int count;				//entity数，不含上方的主光源
+	bool clustered;			//聚成若干团，否则在画布上均匀分布
+	int clusters;			//团数
+	float cluster_radius;	//每团位置的标准差
+	float coverage;			//entity面积之和约占画布的比例，决定entity的平均大小
+	float polygon_ratio;	//凸多边形的比例，其余为圆
+	float emissive_ratio;	//自发光entity的比例
+	float reflective_ratio;	//反射entity的比例，其余为折射
+	unsigned int seed;
+	LargeSceneParams(int n = 1000, bool c = false) :
+		count(n), clustered(c), clusters(16), cluster_radius(0.05f), coverage(0.3f), polygon_ratio(0.5f), emissive_ratio(0.05f), reflective_ratio(0.6f), seed(0) {}
+};
+
+Scene* GenerateLargeScene(const LargeSceneParams& params)	//大量随机的圆和凸多边形
+{
+	Circle* c1 = new Circle({ 0.5f, -0.5f }, 0.05f);
+	list<Entity*> entities = { new Entity(c1, { 20.f, 20.f, 20.f }) };
+	RandomStream rng(params.seed);
+	float refract[3] = { 1.4f, 1.5f, 1.6f };
+	float mean_radius = sqrtf(params.coverage / (TWO_PI / 2.f * max(params.count, 1)));
+	vector<Point> centers;
+	for (int i = 0; i < params.clusters; i++)
+		centers.push_back({ 0.1f + rng.Next() * 0.8f, 0.1f + rng.Next() * 0.8f });
+	for (int i = 0; i < params.count; i++)
+	{
+		Point p = { rng.Next(), rng.Next() };
+		if (params.clustered && !centers.empty())
+		{
+			//Box-Muller变换得到团中心附近的高斯分布
+			Point c = centers[min((int)(rng.Next() * centers.size()), (int)centers.size() - 1)];
+			float r = sqrtf(-2.f * logf(max(p.x, 1e-7f))) * params.cluster_radius, a = TWO_PI * p.y;
+			p = { c.x + r * cosf(a), c.y + r * sinf(a) };
+		}
+		float radius = mean_radius * (0.5f + rng.Next());
+		Shape* shape;
+		if (rng.Next() < params.polygon_ratio)
+		{
+			//3到6个顶点依次落在圆周上，角度单调增加，保证是凸的
+			int sides = 3 + min((int)(rng.Next() * 4), 3);
+			float start = rng.Next() * TWO_PI;
+			vector<Point> points;
+			for (int k = 0; k < sides; k++)
+			{
+				float a = start + TWO_PI * (k + 0.8f * rng.Next()) / sides;
+				points.push_back({ p.x + radius * cosf(a), p.y + radius * sinf(a) });
+			}
+			shape = new ConvexPolygon(points);
+		}
+		else
+			shape = new Circle(p, radius);
+		float material = rng.Next();
+		if (material < params.emissive_ratio)
+			entities.push_back(new Entity(shape, { 2.f + rng.Next() * 8.f, 2.f + rng.Next() * 8.f, 2.f + rng.Next() * 8.f }));
+		else if (material < params.emissive_ratio + params.reflective_ratio)
+			entities.push_back(new Entity(shape, { 0.f, 0.f, 0.f }, 0.8f));
+		else
+			entities.push_back(new Entity(shape, { 0.f, 0.f, 0.f }, 0.1f, 0.8f, refract));
+	}
+	return new Scene(entities);
+}
+
+//"uniform:数量"或"clustered:数量"形式的场景名
+bool ParseLargeScene(const string& name, LargeSceneParams& params)
+{
+	size_t colon = name.find(':');
+	if (colon == string::npos) return false;
+	string layout = name.substr(0, colon);
+	if (layout != "uniform" && layout != "clustered") return false;
+	char* end;
+	long count = strtol(name.c_str() + colon + 1, &end, 10);
+	if (*end || count <= 0 || count > 100000000) return false;
+	params = LargeSceneParams((int)count, layout == "clustered");
+	return true;
+}
+
+//按名字创建场景，用于命令行的--scene参数
+struct SceneEntry
+{
+	const char* name;
+	Scene* (*generate)();
+};
+
+const SceneEntry* GetSceneEntries(int& count)
+{
+	static const SceneEntry entries[] =
+	{
+		{ "lens", GenerateScene },
+		{ "lights", GenerateScene2 },
+		{ "prism", GenerateScene3 },
+		{ "glass", GenerateScene4 },
+		{ "laser", GenerateScene5 },
+		{ "whitelens", GenerateScene6 },
+		{ "spotlight", GenerateScene7 },
+		{ "stars", []() { return GenerateScene8(); } },
+	};
+	count = sizeof(entries) / sizeof(entries[0]);
+	return entries;
+}
+
+//不是内置场景时依次尝试生成的大场景(uniform:数量、clustered:数量)和场景描述文件，都找不到时返回NULL
+//dir非空时场景文件相对于dir查找
+Scene* CreateScene(const string& name, const RenderSettings& settings, const string& dir = "")
+{
+	int count;
+	const SceneEntry* entries = GetSceneEntries(count);
+	for (int i = 0; i < count; i++)
+		if (name == entries[i].name)
+		{
+			Scene* s = entries[i].generate();
+			s->Configure(settings);
+			return s;
+		}
+	LargeSceneParams params;
+	if (ParseLargeScene(name, params))
+	{
+		Scene* s = GenerateLargeScene(params);
+		s->Configure(settings);
+		return s;
+	}
+	SceneFile file;
+	if (!file.Load(dir.empty() || dir.back() == '/' || dir.back() == '\\' ? dir + name : dir + "/" + name))
+	{
+		cerr << file.GetError() << endl;
+		return NULL;
+	}
+	return file.CreateScene(settings);
+}
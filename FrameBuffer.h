@@ -0,0 +1,141 @@
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include "basic.h"
+
+//浮点累加缓冲区：每个像素保存颜色之和与采样次数，多次渲染可以继续累加，输出前再单独做色调映射
+class FrameBuffer
+{
+protected:
+	int m_width, m_height;
+	std::vector<Color> m_sum;
+	std::vector<int> m_count;
+	//一行的色调映射，是否做gamma校正在编译期确定，APPLY_GAMMA为false时内层循环没有分支，可以被编译器向量化
+	template<bool APPLY_GAMMA> void TonemapRow(unsigned char* p, const Color* sum, const int* count, int x0, int x1, float exposure, float inv_gamma)
+	{
+		for (int x = x0; x < x1; x++)
+		{
+			float scale = exposure / (float)(count[x] > 0 ? count[x] : 1);
+			float c[3] = { sum[x].r * scale, sum[x].g * scale, sum[x].b * scale };
+			for (int k = 0; k < 3; k++)
+			{
+				float v = APPLY_GAMMA ? powf(fmaxf(c[k], 0.f), inv_gamma) : c[k];
+				p[x * 3 + k] = (unsigned char)fminf(fmaxf(v * 255.f, 0.f), 255.f);
+			}
+		}
+	}
+public:
+	FrameBuffer(int width = 0, int height = 0) { Resize(width, height); }
+	void Resize(int width, int height)
+	{
+		m_width = width;
+		m_height = height;
+		m_sum.assign(width * height, { 0.f, 0.f, 0.f });
+		m_count.assign(width * height, 0);
+	}
+	void Clear() { Resize(m_width, m_height); }
+	int GetWidth() { return m_width; }
+	int GetHeight() { return m_height; }
+	//累加count次采样之和，不同tile的像素互不重叠，不需要加锁
+	void Add(int x, int y, Color sum, int count = 1)
+	{
+		int i = y * m_width + x;
+		m_sum[i] = m_sum[i] + sum;
+		m_count[i] += count;
+	}
+	Color Get(int x, int y)
+	{
+		int i = y * m_width + x;
+		return m_count[i] ? m_sum[i] / (float)m_count[i] : Color{ 0.f, 0.f, 0.f };
+	}
+	//把平均颜色替换为c，采样次数不变，用于降噪等后处理
+	void Set(int x, int y, Color c)
+	{
+		int i = y * m_width + x;
+		m_sum[i] = c * (float)(m_count[i] > 0 ? m_count[i] : 1);
+	}
+	Color GetSum(int x, int y) { return m_sum[y * m_width + x]; }
+	int GetCount(int x, int y) { return m_count[y * m_width + x]; }
+	const int* GetCounts() { return m_count.data(); }
+	//把[x0, x1) x [y0, y1)内的平均颜色映射为8位RGB写入img(整幅图像，每像素3字节)
+	void Tonemap(unsigned char* img, int x0, int y0, int x1, int y1, float exposure = 1.f, float gamma = 1.f)
+	{
+		float inv_gamma = 1.f / gamma;
+		for (int y = y0; y < y1; y++)
+		{
+			const Color* sum = &m_sum[y * m_width];
+			const int* count = &m_count[y * m_width];
+			unsigned char* p = img + (size_t)y * m_width * 3;
+			if (inv_gamma == 1.f)
+				TonemapRow<false>(p, sum, count, x0, x1, exposure, inv_gamma);
+			else
+				TonemapRow<true>(p, sum, count, x0, x1, exposure, inv_gamma);
+		}
+	}
+	void Tonemap(unsigned char* img, float exposure = 1.f, float gamma = 1.f)
+	{
+		Tonemap(img, 0, 0, m_width, m_height, exposure, gamma);
+	}
+	//只渲染了stride倍数像素的预览：先对这些像素做色调映射，再复制到它右下方stride x stride的块中
+	void TonemapPreview(unsigned char* img, int stride, float exposure = 1.f, float gamma = 1.f)
+	{
+		for (int y = 0; y < m_height; y += stride)
+			for (int x = 0; x < m_width; x += stride)
+			{
+				unsigned char* src = img + ((size_t)y * m_width + x) * 3;
+				Tonemap(img, x, y, x + 1, y + 1, exposure, gamma);
+				for (int by = y; by < std::min(y + stride, m_height); by++)
+					for (int bx = x; bx < std::min(x + stride, m_width); bx++)
+						memcpy(img + ((size_t)by * m_width + bx) * 3, src, 3);
+			}
+	}
+	//以PFM格式保存平均颜色，无损保留浮点值；不保存采样次数，文件只用于重新做色调映射(--tonemap)
+	bool WritePfm(const std::string& filename)
+	{
+		FILE* fp = fopen(filename.c_str(), "wb");
+		if (!fp) return false;
+		fprintf(fp, "PF\n%d %d\n-1.0\n", m_width, m_height);		//负的比例表示小端
+		std::vector<float> row(m_width * 3);
+		bool ok = true;
+		for (int y = m_height - 1; y >= 0 && ok; y--)		//PFM从最下面一行开始
+		{
+			for (int x = 0; x < m_width; x++)
+			{
+				Color c = Get(x, y);
+				row[x * 3] = c.r, row[x * 3 + 1] = c.g, row[x * 3 + 2] = c.b;
+			}
+			ok = fwrite(row.data(), sizeof(float), row.size(), fp) == row.size();
+		}
+		ok = fclose(fp) == 0 && ok;
+		return ok;
+	}
+	//读取PFM，只支持小端的RGB格式；文件里没有采样次数，每个像素都记为一次采样，
+	//读入的结果只能做色调映射，不能再和新的渲染结果累加
+	bool ReadPfm(const std::string& filename)
+	{
+		FILE* fp = fopen(filename.c_str(), "rb");
+		if (!fp) return false;
+		char type[3] = { 0 };
+		int width, height;
+		float scale;
+		bool ok = fscanf(fp, "%2s %d %d %f", type, &width, &height, &scale) == 4
+			&& std::string(type) == "PF" && scale < 0.f && width > 0 && height > 0 && fgetc(fp) != EOF;
+		if (ok)
+		{
+			Resize(width, height);
+			std::vector<float> row(width * 3);
+			for (int y = height - 1; y >= 0 && ok; y--)
+			{
+				ok = fread(row.data(), sizeof(float), row.size(), fp) == row.size();
+				for (int x = 0; ok && x < width; x++)
+					Add(x, y, { row[x * 3], row[x * 3 + 1], row[x * 3 + 2] });
+			}
+		}
+		fclose(fp);
+		return ok;
+	}
+};
@@ -0,0 +1,182 @@
+#pragma once
+#include <list>
+#include <vector>
+#include <iostream>
+#include <math.h>
+#include <algorithm>
+#include "Shape.h"
+#include "Stats.h"
+using std::list;
+using std::vector;
+
+#define GRID_CELLS_PER_ENTITY 1.f	//自动选择分辨率时格子数约为有界entity数的倍数
+#define GRID_MIN_CELL 1.f			//格子边长不小于entity平均尺寸的这个倍数，避免大entity被大量格子重复引用
+#define GRID_MAX_RES 1024			//每个方向格子数的上限
+#define GRID_MAILBOX 8				//记住最近测试过的entity，跨多个格子的entity不重复求交
+
+//均匀网格：覆盖所有有界entity的包围盒，每个格子记录与之重叠的entity编号，
+//适合大量尺寸相近、分布均匀的entity，遍历是二维DDA，找到比下一条格子边界更近的交点就停止
+template<typename T> class UniformGrid
+{
+protected:
+	Bound m_bound;				//网格覆盖的范围
+	int m_res_x, m_res_y;		//没有有界entity时为0
+	float m_cell_x, m_cell_y;
+	vector<int> m_cell_first;	//格子(y * m_res_x + x)的entity编号在m_refs中的范围为[m_cell_first[i], m_cell_first[i + 1])
+	vector<int> m_refs;
+	vector<int> m_unbounded;	//无界的entity(如半平面)，每条射线都要测试
+	vector<T*> m_data;
+
+	//按有界entity的个数和平均尺寸选择分辨率
+	void ChooseResolution(int count, float average_size)
+	{
+		float width = m_bound.right - m_bound.left, height = m_bound.down - m_bound.up;
+		float cell = sqrtf(width * height / (count * GRID_CELLS_PER_ENTITY));
+		cell = std::max(cell, average_size * GRID_MIN_CELL);
+		if (!(cell > 0.f))
+			cell = std::max(width, height);
+		m_res_x = std::min(std::max((int)ceilf(width / cell), 1), GRID_MAX_RES);
+		m_res_y = std::min(std::max((int)ceilf(height / cell), 1), GRID_MAX_RES);
+		m_cell_x = width / m_res_x;
+		m_cell_y = height / m_res_y;
+	}
+	int GetCellX(float x) { return std::min(std::max((int)((x - m_bound.left) / m_cell_x), 0), m_res_x - 1); }
+	int GetCellY(float y) { return std::min(std::max((int)((y - m_bound.up) / m_cell_y), 0), m_res_y - 1); }
+	void IntersectItem(int index, Point p, Vector d, T* &ent, Point& inter, Vector& normal, float& dist)
+	{
+		Point tmp_inter;
+		Vector tmp_normal;
+		if (m_data[index]->Intersect(p, d, tmp_inter, tmp_normal))
+		{
+			float tmp_dist = (tmp_inter - p).len();
+			if (dist > tmp_dist)
+			{
+				ent = m_data[index];
+				dist = tmp_dist;
+				inter = tmp_inter;
+				normal = tmp_normal;
+			}
+		}
+	}
+public:
+	UniformGrid(list<T*> data) : m_res_x(0), m_res_y(0), m_cell_x(0.f), m_cell_y(0.f), m_data(data.begin(), data.end())
+	{
+		vector<Bound> bounds;
+		vector<int> items;
+		float size = 0.f;
+		m_bound.Reset();
+		for (int i = 0; i < (int)m_data.size(); i++)
+		{
+			Bound b;
+			if (m_data[i]->GetBound(b.left, b.right, b.up, b.down))
+			{
+				//稍微放大，避免交点恰好落在格子边界上
+				b.left -= EPSILON, b.right += EPSILON, b.up -= EPSILON, b.down += EPSILON;
+				bounds.push_back(b);
+				items.push_back(i);
+				m_bound.Expand(b);
+				size += std::max(b.right - b.left, b.down - b.up);
+			}
+			else
+				m_unbounded.push_back(i);
+		}
+		if (items.empty())
+			return;
+		ChooseResolution((int)items.size(), size / items.size());
+		//先数出每个格子的引用数，再按前缀和填入
+		m_cell_first.assign((size_t)m_res_x * m_res_y + 1, 0);
+		for (auto& b : bounds)
+			for (int y = GetCellY(b.up); y <= GetCellY(b.down); y++)
+				for (int x = GetCellX(b.left); x <= GetCellX(b.right); x++)
+					m_cell_first[y * m_res_x + x + 1]++;
+		for (size_t i = 1; i < m_cell_first.size(); i++)
+			m_cell_first[i] += m_cell_first[i - 1];
+		m_refs.resize(m_cell_first.back());
+		vector<int> fill(m_cell_first.begin(), m_cell_first.end() - 1);
+		for (size_t k = 0; k < bounds.size(); k++)
+		{
+			const Bound& b = bounds[k];
+			for (int y = GetCellY(b.up); y <= GetCellY(b.down); y++)
+				for (int x = GetCellX(b.left); x <= GetCellX(b.right); x++)
+					m_refs[fill[y * m_res_x + x]++] = items[k];
+		}
+	}
+	int GetResolutionX() { return m_res_x; }
+	int GetResolutionY() { return m_res_y; }
+	int GetRefCount() { return (int)m_refs.size(); }
+	//格子和entity编号占用的内存(字节)
+	size_t GetMemoryUsage()
+	{
+		return (m_cell_first.size() + m_refs.size() + m_unbounded.size()) * sizeof(int) + m_data.size() * sizeof(T*);
+	}
+	void PrintStats(std::ostream& out)
+	{
+		int empty = 0;
+		for (size_t i = 0; i + 1 < m_cell_first.size(); i++)
+			if (m_cell_first[i] == m_cell_first[i + 1])
+				empty++;
+		int bounded = (int)(m_data.size() - m_unbounded.size());
+		out << "grid: " << m_res_x << "x" << m_res_y << " cells, " << empty << " empty, "
+			<< (bounded ? (double)m_refs.size() / bounded : 0.0) << " cells per entity, "
+			<< m_unbounded.size() << " unbounded, " << GetMemoryUsage() << " bytes" << std::endl;
+	}
+	//返回射线相交的最近entity、交点和交点处的法向，从射线进入网格的格子开始逐格前进
+	void Intersect(Point p, Vector d, T* &ent, Point &inter, Vector &normal)
+	{
+		float dist = 10.f;
+		for (int index : m_unbounded)
+			IntersectItem(index, p, d, ent, inter, normal, dist);
+		if (m_res_x == 0) return;
+		Vector inv_d = { 1.f / d.x, 1.f / d.y };
+		float t_near;
+		if (!m_bound.Intersect(p, inv_d, dist, t_near)) return;
+		Point start = p + d * t_near;
+		int x = GetCellX(start.x), y = GetCellY(start.y);
+		int step_x = d.x > 0.f ? 1 : -1, step_y = d.y > 0.f ? 1 : -1;
+		//t_max为射线到达下一条竖直(水平)格子边界的距离，t_delta为穿过一个格子的距离
+		float t_max_x = 1e30f, t_max_y = 1e30f, t_delta_x = 1e30f, t_delta_y = 1e30f;
+		if (d.x != 0.f)
+		{
+			t_max_x = (m_bound.left + (x + (step_x > 0)) * m_cell_x - p.x) * inv_d.x;
+			t_delta_x = m_cell_x * fabsf(inv_d.x);
+		}
+		if (d.y != 0.f)
+		{
+			t_max_y = (m_bound.up + (y + (step_y > 0)) * m_cell_y - p.y) * inv_d.y;
+			t_delta_y = m_cell_y * fabsf(inv_d.y);
+		}
+		int mailbox[GRID_MAILBOX];
+		for (int i = 0; i < GRID_MAILBOX; i++)
+			mailbox[i] = -1;
+		int next = 0;
+		while (true)
+		{
+			STAT_ADD(nodes, 1);
+			int cell = y * m_res_x + x;
+			for (int i = m_cell_first[cell]; i < m_cell_first[cell + 1]; i++)
+			{
+				int index = m_refs[i];
+				if (std::find(mailbox, mailbox + GRID_MAILBOX, index) != mailbox + GRID_MAILBOX)
+					continue;
+				mailbox[next] = index;
+				next = (next + 1) % GRID_MAILBOX;
+				IntersectItem(index, p, d, ent, inter, normal, dist);
+			}
+			//后面格子里的交点都不会比离开当前格子的距离更近
+			float t_exit = std::min(t_max_x, t_max_y);
+			if (dist <= t_exit) break;
+			if (t_max_x < t_max_y)
+			{
+				x += step_x;
+				if (x < 0 || x >= m_res_x) break;
+				t_max_x += t_delta_x;
+			}
+			else
+			{
+				y += step_y;
+				if (y < 0 || y >= m_res_y) break;
+				t_max_y += t_delta_y;
+			}
+		}
+	}
+};
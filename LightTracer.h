@@ -0,0 +1,273 @@
+#pragma once
+#include <vector>
+#include <chrono>
+#include <iostream>
+#include <algorithm>
+#include <functional>
+#include "Scene.h"
+#include "FrameBuffer.h"
+#include "ThreadPool.h"
+#include "Renderer.h"
+#include "Trace.h"
+
+#define LIGHT_TRACE_BATCH 4096		//每个任务追踪的光子数
+#define LIGHT_TRACE_BAND 32			//合并各线程缓冲区时每个任务处理的行数
+#define LIGHT_TRACE_CROSSINGS 16	//一条直线与光源边界最多的交点数
+
+//正向光线追踪：从自发光entity发出光子，经过反射和折射后，按光子在每个像素内经过的长度累加能量(track-length估计)
+//焦散和色散的光路从像素出发很难找到，从光源出发则每个光子都能贡献，像素的值与Scene::Sample一致，都是各方向收到的emissive的平均值
+//光源发出的光相当于一组直线：在包围盒外接圆上均匀选方向和偏移，直线与光源边界的每个交点都沿直线方向发光，
+//与Sample中从内部或外部射到光源边界都得到emissive一致；聚光灯只在它的张角内选方向
+//无界的光源用覆盖画面的圆代替外接圆，画面外很远处发出、再被反射回画面的光会被忽略
+class LightTracer
+{
+protected:
+	struct Emitter
+	{
+		Entity* ent;
+		Point center;		//包围盒的外接圆，无界时为覆盖画面的圆
+		float radius;
+		float angle;		//出射方向的起始角度
+		float range;		//出射方向的范围，普通光源为2PI
+		float measure;		//采样的直线测度range * 2 * radius
+		float cdf;			//按亮度乘测度选中的累积概率
+	};
+	Scene* m_scene;
+	ThreadPool* m_pool;
+	std::vector<Emitter> m_emitters;
+	float m_total;			//所有光源亮度乘测度之和
+	int m_width, m_height;
+	std::vector<std::vector<Color>> m_buffers;		//每个线程一个累加缓冲区，最后合并，追踪时不需要加锁
+	std::function<void(const Tile&)> m_on_tile;
+	double m_wall_time;
+	long long m_lines;		//发出光子的直线数
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	static float Luminance(Color c) { return c.r + c.g + c.b; }
+	//选一个光源和一条直线，从外接圆外沿-d依次求出直线与光源边界的交点，每个交点沿d发出一个光子
+	//聚光灯的Intersect同时过滤了张角外的方向；它只挡住射向自己的射线，对光子正好相反，所以内部交点的光子只走到上一个交点
+	void Emit(std::vector<Color>& buf, RandomStream& rng)
+	{
+		float u = rng.Next();
+		int i = (int)(std::upper_bound(m_emitters.begin(), m_emitters.end(), u, [](float v, const Emitter& e) { return v < e.cdf; }) - m_emitters.begin());
+		Emitter e = m_emitters[std::min(i, (int)m_emitters.size() - 1)];
+		float a = e.angle + rng.Next() * e.range;
+		Vector d = { cosf(a), sinf(a) };
+		Vector perp = { -d.y, d.x };
+		Color power = e.ent->GetEmissive() * (m_total / Luminance(e.ent->GetEmissive()));
+		Point p = e.center + perp * ((rng.Next() * 2.f - 1.f) * e.radius) + d * (e.radius + BIAS);
+		Point inter, prev;
+		Vector dir;
+		float half;
+		bool cone = e.ent->GetEmissionCone(dir, half);
+		for (int k = 0; k < LIGHT_TRACE_CROSSINGS && e.ent->Intersect(p, d * -1.f, inter); k++)
+		{
+			if (cone && k > 0)
+				Splat(buf, inter, prev, power);
+			else
+				TracePhoton(buf, rng, inter + d * BIAS, d, power);
+			prev = inter;
+			p = inter - d * BIAS;
+		}
+	}
+	//把从a到b的线段按经过每个像素的长度累加到buf，像素(x, y)覆盖以(x / width, y / height)为中心的格子
+	void Splat(std::vector<Color>& buf, Point a, Point b, Color power)
+	{
+		float gx = a.x * m_width + 0.5f, gy = a.y * m_height + 0.5f;
+		float len = (b - a).len();
+		if (len <= 0.f) return;
+		float dx = (b.x - a.x) * m_width / len, dy = (b.y - a.y) * m_height / len;	//每单位长度在格子坐标中的变化
+		//把线段裁剪到[0, width) x [0, height)
+		float t0 = 0.f, t1 = len;
+		float lo[2] = { gx, gy }, dir[2] = { dx, dy }, hi[2] = { (float)m_width, (float)m_height };
+		for (int k = 0; k < 2; k++)
+		{
+			if (dir[k] == 0.f)
+			{
+				if (lo[k] < 0.f || lo[k] >= hi[k]) return;
+				continue;
+			}
+			float ta = -lo[k] / dir[k], tb = (hi[k] - lo[k]) / dir[k];
+			if (ta > tb) std::swap(ta, tb);
+			t0 = fmaxf(t0, ta);
+			t1 = fminf(t1, tb);
+		}
+		if (t0 >= t1) return;
+		//2D DDA逐个经过格子
+		float te = t0 + fminf((t1 - t0) * 0.5f, 1e-5f);		//起点可能正好在格子边界上，稍微向前取
+		int ix = std::min(std::max((int)floorf(gx + dx * te), 0), m_width - 1);
+		int iy = std::min(std::max((int)floorf(gy + dy * te), 0), m_height - 1);
+		int sx = dx > 0.f ? 1 : -1, sy = dy > 0.f ? 1 : -1;
+		float delta_x = dx != 0.f ? 1.f / fabsf(dx) : 1e30f, delta_y = dy != 0.f ? 1.f / fabsf(dy) : 1e30f;
+		float next_x = dx != 0.f ? ((ix + (dx > 0.f ? 1 : 0)) - gx) / dx : 1e30f;
+		float next_y = dy != 0.f ? ((iy + (dy > 0.f ? 1 : 0)) - gy) / dy : 1e30f;
+		float t = t0;
+		while (true)
+		{
+			float tn = fminf(fminf(next_x, next_y), t1);
+			if (tn > t)
+				buf[iy * m_width + ix] = buf[iy * m_width + ix] + power * (tn - t);
+			t = tn;
+			if (t >= t1) break;
+			if (next_x <= next_y)
+			{
+				ix += sx;
+				next_x += delta_x;
+				if (ix < 0 || ix >= m_width) break;
+			}
+			else
+			{
+				iy += sy;
+				next_y += delta_y;
+				if (iy < 0 || iy >= m_height) break;
+			}
+		}
+	}
+	//与Scene::TracePath对称：每段路径都累加到缓冲区，相交后按反射率和折射率随机选择方向，白光折射时随机选一个颜色
+	//Sample中的radiance经过折射不变，而光子保持的是能量，所以折射时再乘以两侧折射率之比
+	void TracePhoton(std::vector<Color>& buf, RandomStream& rng, Point p, Vector d, Color power)
+	{
+		Color throughput = { 1.f, 1.f, 1.f };
+		const int bins = m_scene->GetSettings().bins;
+		int color_index = bins;
+		for (int depth = 0; ; depth++)
+		{
+			Point inter;
+			Vector normal;
+			Entity* ent = m_scene->FindNearest(p, d, inter, normal);
+			Splat(buf, p, ent ? inter : p + d * 10.f, power * throughput);
+			if (!ent || depth >= PATH_MAX_DEPTH) break;
+			float reflectivity = ent->GetReflectivity();
+			float refractivity = ent->GetRefractivity();
+			int refract_index = color_index;
+			Color spectral = { 1.f, 1.f, 1.f };
+			if (refractivity > 0.f && color_index == bins)
+			{
+				refract_index = std::min((int)(rng.Next() * bins), bins - 1);
+				spectral = m_scene->GetRefractColor(refract_index, bins) * 2.f;
+			}
+			Vector refract = d;
+			bool can_refract = refractivity > 0.f && m_scene->GetRefractDirection(ent, d, normal, refract_index, refract);
+#if USE_FRESNEL
+			if (refractivity > 0.f)
+			{
+				float fresnel = can_refract ? m_scene->GetFresnel(ent, d, normal, refract_index) : 1.f;
+				reflectivity += refractivity * fresnel;
+				refractivity *= 1.f - fresnel;
+			}
+#endif
+			if (!can_refract)
+				refractivity = 0.f;
+			float total = reflectivity + refractivity;
+			if (total <= 0.f) break;
+			if (rng.Next() * total < reflectivity)
+				d = d.reflect(normal);
+			else
+			{
+				float ri = ent->GetRefractIndex(refract_index);
+				throughput = throughput * spectral * (d * normal > 0.f ? ri : 1.f / ri);
+				d = refract;
+				color_index = refract_index;
+			}
+			throughput = throughput * total;
+			if (depth + 1 >= RR_DEPTH)
+			{
+				float q = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 1.f);
+				if (rng.Next() >= q) break;
+				throughput = throughput / q;
+			}
+			p = inter + d * BIAS;
+		}
+	}
+public:
+	LightTracer(Scene* scene, ThreadPool* pool) : m_scene(scene), m_pool(pool), m_total(0.f), m_width(0), m_height(0), m_wall_time(0.0), m_lines(0)
+	{
+		for (auto ent : scene->GetEntities())
+		{
+			if (Luminance(ent->GetEmissive()) <= 0.f) continue;
+			float left, right, up, down;
+			if (!ent->GetBound(left, right, up, down))
+				left = up = -0.5f, right = down = 1.5f;
+			Emitter e;
+			e.ent = ent;
+			e.center = { (left + right) / 2.f, (up + down) / 2.f };
+			e.radius = sqrtf((right - left) * (right - left) + (down - up) * (down - up)) / 2.f;
+			e.angle = 0.f;
+			e.range = TWO_PI;
+			Vector dir;
+			float half;
+			if (ent->GetEmissionCone(dir, half))
+			{
+				e.angle = atan2f(dir.y, dir.x) - half;
+				e.range = 2.f * half;
+			}
+			e.measure = e.range * 2.f * e.radius;
+			m_total += Luminance(ent->GetEmissive()) * e.measure;
+			e.cdf = m_total;
+			m_emitters.push_back(e);
+		}
+		for (auto& e : m_emitters)
+			e.cdf /= m_total;
+	}
+	void SetTileCallback(std::function<void(const Tile&)> on_tile) { m_on_tile = on_tile; }
+	//平均每个像素从光源发出paths条光路，结果作为一次采样累加到fb中；每个tile是若干整行，合并完成后调用tile回调
+	void Render(FrameBuffer& fb, int paths, unsigned int seed)
+	{
+		m_width = fb.GetWidth();
+		m_height = fb.GetHeight();
+		m_lines = m_emitters.empty() ? 0 : (long long)paths * m_width * m_height;
+		m_buffers.assign(m_pool->GetThreadCount() + 1, std::vector<Color>());
+		TraceScope trace("light trace");
+		double start = Now();
+		for (long long first = 0; first < m_lines; first += LIGHT_TRACE_BATCH)
+		{
+			long long last = std::min(first + LIGHT_TRACE_BATCH, m_lines);
+			m_pool->Submit([this, first, last, seed]()
+			{
+				TraceScope trace("photons");
+				std::vector<Color>& buf = m_buffers[m_pool->GetWorkerIndex()];
+				if (buf.empty())
+					buf.assign(m_width * m_height, { 0.f, 0.f, 0.f });
+				for (long long i = first; i < last; i++)
+				{
+					RandomStream rng(seed, (unsigned int)(i >> 32), (unsigned int)i);
+					Emit(buf, rng);
+				}
+			});
+		}
+		m_pool->Wait();
+		//每个光子的能量已除以选中的概率，再除以光子数、像素面积和2PI得到各方向的平均值
+		float scale = m_lines ? (float)m_width * m_height / (TWO_PI * m_lines) : 0.f;
+		for (int y = 0; y < m_height; y += LIGHT_TRACE_BAND)
+		{
+			Tile tile = { 0, y, m_width, std::min(y + LIGHT_TRACE_BAND, m_height) };
+			m_pool->Submit([this, tile, scale, &fb]()
+			{
+				TraceScope trace("merge", tile.x0, tile.y0);
+				for (int y = tile.y0; y < tile.y1; y++)
+					for (int x = tile.x0; x < tile.x1; x++)
+					{
+						Color sum = { 0.f, 0.f, 0.f };
+						for (auto& buf : m_buffers)
+							if (!buf.empty())
+								sum = sum + buf[y * m_width + x];
+						fb.Add(x, y, sum * scale);
+					}
+				if (m_on_tile)
+					m_on_tile(tile);
+			});
+		}
+		m_pool->Wait();
+		m_buffers.clear();
+		m_wall_time = Now() - start;
+	}
+	double GetWallTime() { return m_wall_time; }
+	void PrintStats(std::ostream& out)
+	{
+		out << "threads: " << m_pool->GetThreadCount() << ", time: " << m_wall_time << "s, "
+			<< m_lines << " light paths, " << m_lines / m_wall_time << " paths/s" << std::endl;
+	}
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include <stddef.h>
+#include <string>
+#include <sys/stat.h>
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN		//不引入winsock.h，以便与winsock2.h一起使用
+#endif
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+//只读映射整个文件
+class MappedFile
+{
+protected:
+	const char* m_data;
+	size_t m_size;
+#ifdef _WIN32
+	HANDLE m_file, m_mapping;
+#else
+	int m_fd;
+#endif
+public:
+	MappedFile() : m_data(NULL), m_size(0)
+#ifdef _WIN32
+		, m_file(INVALID_HANDLE_VALUE), m_mapping(NULL)
+#else
+		, m_fd(-1)
+#endif
+	{}
+	~MappedFile() { Close(); }
+	bool Open(const std::string& filename)
+	{
+		Close();
+#ifdef _WIN32
+		m_file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (m_file == INVALID_HANDLE_VALUE) return false;
+		LARGE_INTEGER size;
+		GetFileSizeEx(m_file, &size);
+		m_size = (size_t)size.QuadPart;
+		if (m_size == 0) return false;
+		m_mapping = CreateFileMappingA(m_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (!m_mapping) return false;
+		m_data = (const char*)MapViewOfFile(m_mapping, FILE_MAP_READ, 0, 0, 0);
+#else
+		m_fd = open(filename.c_str(), O_RDONLY);
+		if (m_fd < 0) return false;
+		struct stat st;
+		if (fstat(m_fd, &st) != 0 || st.st_size == 0) return false;
+		m_size = (size_t)st.st_size;
+		void* p = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, m_fd, 0);
+		m_data = p == MAP_FAILED ? NULL : (const char*)p;
+#endif
+		return m_data != NULL;
+	}
+	void Close()
+	{
+#ifdef _WIN32
+		if (m_data) UnmapViewOfFile(m_data);
+		if (m_mapping) CloseHandle(m_mapping);
+		if (m_file != INVALID_HANDLE_VALUE) CloseHandle(m_file);
+		m_file = INVALID_HANDLE_VALUE, m_mapping = NULL;
+#else
+		if (m_data) munmap((void*)m_data, m_size);
+		if (m_fd >= 0) close(m_fd);
+		m_fd = -1;
+#endif
+		m_data = NULL;
+		m_size = 0;
+	}
+	const char* GetData() { return m_data; }
+	size_t GetSize() { return m_size; }
+};
@@ -0,0 +1,365 @@
+// PNG输出：按行带分块压缩，每个行带渲染完成后立即在完成它的线程中压缩，与其余tile的渲染重叠
+#pragma once
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "Trace.h"
+
+#define PNG_BAND_ROWS 32		//每个行带的行数，各行带独立压缩后按顺序拼接
+#define PNG_HASH_BITS 15
+#define PNG_WINDOW 32768		//deflate的最大回溯距离
+#define PNG_MAX_CHAIN 32		//每个位置最多比较的候选数，越大压缩率越高也越慢
+#define PNG_MIN_MATCH 3
+#define PNG_MAX_MATCH 258
+
+//deflate压缩：LZ77 + 固定Huffman编码，输出不含zlib头和Adler-32
+class Deflate
+{
+protected:
+	std::vector<unsigned char>& m_out;
+	uint32_t m_bits;
+	int m_count;
+
+	//按LSB优先写入n位
+	void PutBits(uint32_t value, int n)
+	{
+		m_bits |= value << m_count;
+		m_count += n;
+		while (m_count >= 8)
+		{
+			m_out.push_back((unsigned char)m_bits);
+			m_bits >>= 8;
+			m_count -= 8;
+		}
+	}
+	//Huffman码按MSB优先存储，需要反转后写入
+	void PutCode(uint32_t code, int n)
+	{
+		uint32_t r = 0;
+		for (int i = 0; i < n; i++)
+			r |= ((code >> i) & 1) << (n - 1 - i);
+		PutBits(r, n);
+	}
+	void PutLiteral(int c)
+	{
+		if (c < 144) PutCode(0x30 + c, 8);
+		else if (c < 256) PutCode(0x190 + c - 144, 9);
+		else if (c < 280) PutCode(c - 256, 7);
+		else PutCode(0xc0 + c - 280, 8);
+	}
+	void PutMatch(int length, int distance)
+	{
+		static const int length_base[] = { 3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31, 35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258 };
+		static const int length_extra[] = { 0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2, 3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0 };
+		static const int dist_base[] = { 1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193, 257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145, 8193, 12289, 16385, 24577 };
+		static const int dist_extra[] = { 0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13 };
+		int l = 28;
+		while (length_base[l] > length)
+			l--;
+		PutLiteral(257 + l);
+		PutBits(length - length_base[l], length_extra[l]);
+		int d = 29;
+		while (dist_base[d] > distance)
+			d--;
+		PutCode(d, 5);
+		PutBits(distance - dist_base[d], dist_extra[d]);
+	}
+	//补齐到字节边界
+	void Align()
+	{
+		if (m_count > 0)
+			PutBits(0, 8 - m_count);
+	}
+	static uint32_t Hash(const unsigned char* p)
+	{
+		return ((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - PNG_HASH_BITS);
+	}
+public:
+	Deflate(std::vector<unsigned char>& out) : m_out(out), m_bits(0), m_count(0) {}
+	//压缩data为一个固定Huffman块，last为false时以空的stored块结束并对齐到字节，之后可以直接拼接下一段
+	void Compress(const unsigned char* data, int size, bool last)
+	{
+		PutBits(last ? 1 : 0, 1);
+		PutBits(1, 2);		//固定Huffman
+		std::vector<int> head(1 << PNG_HASH_BITS, -1);
+		std::vector<int> prev(PNG_WINDOW, -1);
+		int i = 0;
+		while (i < size)
+		{
+			int best_len = 0, best_dist = 0;
+			if (i + PNG_MIN_MATCH <= size)
+			{
+				uint32_t h = Hash(data + i);
+				int max_len = size - i < PNG_MAX_MATCH ? size - i : PNG_MAX_MATCH;
+				int j = head[h];
+				for (int chain = 0; j >= 0 && i - j <= PNG_WINDOW && chain < PNG_MAX_CHAIN; chain++)
+				{
+					if (data[j + best_len] == data[i + best_len])
+					{
+						int len = 0;
+						while (len < max_len && data[j + len] == data[i + len])
+							len++;
+						if (len > best_len)
+						{
+							best_len = len, best_dist = i - j;
+							if (len == max_len) break;
+						}
+					}
+					int next = prev[j % PNG_WINDOW];
+					if (next >= j) break;
+					j = next;
+				}
+			}
+			int step = best_len >= PNG_MIN_MATCH ? best_len : 1;
+			if (step > 1)
+				PutMatch(best_len, best_dist);
+			else
+				PutLiteral(data[i]);
+			//匹配到的每个位置都加入哈希链
+			for (int k = 0; k < step; k++, i++)
+				if (i + PNG_MIN_MATCH <= size)
+				{
+					uint32_t h = Hash(data + i);
+					prev[i % PNG_WINDOW] = head[h];
+					head[h] = i;
+				}
+		}
+		PutLiteral(256);
+		if (!last)
+		{
+			PutBits(0, 3);		//stored块，BFINAL = 0
+			Align();
+			PutBits(0, 16);
+			PutBits(0xffff, 16);
+		}
+		Align();
+	}
+};
+
+//按行带接收渲染好的像素，压缩完成的行带按顺序写成IDAT
+class PngWriter
+{
+protected:
+	struct Band
+	{
+		std::vector<unsigned char> data;	//压缩后的deflate数据
+		uint32_t adler;						//未压缩数据的Adler-32
+		int size;							//未压缩数据的字节数
+		bool ready;
+	};
+	FILE* m_fp;
+	const unsigned char* m_img;
+	int m_width, m_height;
+	int m_band_rows;
+	std::vector<Band> m_bands;
+	std::vector<std::atomic<int>> m_remaining;		//每个行带还没完成的像素数
+	std::mutex m_lock;
+	int m_next;				//下一个要写入文件的行带
+	uint32_t m_adler;
+
+	static uint32_t Crc(const unsigned char* data, size_t size, uint32_t crc = 0xffffffffu)
+	{
+		static uint32_t table[256];
+		static bool init = [] {
+			for (uint32_t i = 0; i < 256; i++)
+			{
+				uint32_t c = i;
+				for (int k = 0; k < 8; k++)
+					c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+				table[i] = c;
+			}
+			return true;
+		}();
+		(void)init;
+		for (size_t i = 0; i < size; i++)
+			crc = table[(crc ^ data[i]) & 0xff] ^ (crc >> 8);
+		return crc;
+	}
+	static uint32_t Adler(const unsigned char* data, size_t size)
+	{
+		uint32_t a = 1, b = 0;
+		while (size > 0)
+		{
+			size_t n = size < 5552 ? size : 5552;		//5552字节内不会溢出
+			size -= n;
+			for (; n > 0; n--)
+			{
+				a += *data++;
+				b += a;
+			}
+			a %= 65521;
+			b %= 65521;
+		}
+		return b << 16 | a;
+	}
+	//由两段各自的Adler-32求拼接后的Adler-32，len2为第二段的长度
+	static uint32_t AdlerCombine(uint32_t adler1, uint32_t adler2, uint32_t len2)
+	{
+		const uint32_t base = 65521;
+		uint32_t rem = len2 % base;
+		uint32_t sum1 = adler1 & 0xffff;
+		uint32_t sum2 = (uint32_t)(((uint64_t)rem * sum1) % base);
+		sum1 += (adler2 & 0xffff) + base - 1;
+		sum2 += (adler1 >> 16) + (adler2 >> 16) + base - rem;
+		if (sum1 >= base) sum1 -= base;
+		if (sum1 >= base) sum1 -= base;
+		if (sum2 >= base << 1) sum2 -= base << 1;
+		if (sum2 >= base) sum2 -= base;
+		return sum2 << 16 | sum1;
+	}
+	static void Put32(unsigned char* p, uint32_t v)
+	{
+		p[0] = v >> 24, p[1] = v >> 16, p[2] = v >> 8, p[3] = v;
+	}
+	void WriteChunk(const char* type, const unsigned char* data, size_t size)
+	{
+		unsigned char buf[4];
+		Put32(buf, (uint32_t)size);
+		fwrite(buf, 1, 4, m_fp);
+		fwrite(type, 1, 4, m_fp);
+		if (size)
+			fwrite(data, 1, size, m_fp);
+		uint32_t crc = Crc((const unsigned char*)type, 4);
+		Put32(buf, ~Crc(data, size, crc));
+		fwrite(buf, 1, 4, m_fp);
+	}
+	static int Paeth(int a, int b, int c)
+	{
+		int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+		return pa <= pb && pa <= pc ? a : (pb <= pc ? b : c);
+	}
+	//对一行选择绝对值之和最小的滤波方式，prev为NULL时只能用不依赖上一行的None和Sub
+	void FilterRow(const unsigned char* row, const unsigned char* prev, unsigned char* out)
+	{
+		int n = m_width * 3;
+		std::vector<unsigned char> tmp(n);
+		unsigned best_sum = ~0u;
+		for (int f = 0; f < (prev ? 5 : 2); f++)
+		{
+			unsigned sum = 0;
+			for (int i = 0; i < n; i++)
+			{
+				int a = i >= 3 ? row[i - 3] : 0, b = prev ? prev[i] : 0, c = prev && i >= 3 ? prev[i - 3] : 0;
+				int pred = f == 0 ? 0 : f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) / 2 : Paeth(a, b, c);
+				tmp[i] = (unsigned char)(row[i] - pred);
+				sum += tmp[i] < 128 ? tmp[i] : 256 - tmp[i];
+			}
+			if (sum < best_sum)
+			{
+				best_sum = sum;
+				out[0] = (unsigned char)f;
+				memcpy(out + 1, tmp.data(), n);
+			}
+		}
+	}
+	//滤波并压缩第index个行带，行带的第一行不引用上一个行带，因此各行带可以任意顺序压缩
+	void CompressBand(int index)
+	{
+		TraceScope trace("png encode", 0, index * m_band_rows);
+		int y0 = index * m_band_rows, y1 = y0 + m_band_rows < m_height ? y0 + m_band_rows : m_height;
+		int stride = m_width * 3;
+		std::vector<unsigned char> filtered((size_t)(y1 - y0) * (stride + 1));
+		for (int y = y0; y < y1; y++)
+			FilterRow(m_img + (size_t)y * stride, y > y0 ? m_img + (size_t)(y - 1) * stride : NULL, &filtered[(size_t)(y - y0) * (stride + 1)]);
+		Band& band = m_bands[index];
+		Deflate deflate(band.data);
+		deflate.Compress(filtered.data(), (int)filtered.size(), index + 1 == (int)m_bands.size());
+		band.adler = Adler(filtered.data(), filtered.size());
+		band.size = (int)filtered.size();
+		std::lock_guard<std::mutex> guard(m_lock);
+		band.ready = true;
+		Flush();
+	}
+	//按顺序写出已经压缩好的行带，需持有m_lock
+	void Flush()
+	{
+		while (m_next < (int)m_bands.size() && m_bands[m_next].ready)
+		{
+			Band& band = m_bands[m_next];
+			if (m_next == 0)
+			{
+				static const unsigned char zlib_header[] = { 0x78, 0x01 };
+				WriteChunk("IDAT", zlib_header, 2);
+				m_adler = band.adler;
+			}
+			else
+				m_adler = AdlerCombine(m_adler, band.adler, band.size);
+			WriteChunk("IDAT", band.data.data(), band.data.size());
+			std::vector<unsigned char>().swap(band.data);
+			m_next++;
+		}
+	}
+public:
+	//img为RGB图像，在Finish之前必须保持有效
+	PngWriter(const std::string& filename, const unsigned char* img, int width, int height, int band_rows = PNG_BAND_ROWS) :
+		m_img(img), m_width(width), m_height(height), m_band_rows(band_rows), m_next(0), m_adler(1)
+	{
+		int count = (height + band_rows - 1) / band_rows;
+		m_bands.resize(count);
+		m_remaining = std::vector<std::atomic<int>>(count);
+		for (int i = 0; i < count; i++)
+		{
+			int rows = i + 1 < count ? band_rows : height - i * band_rows;
+			m_remaining[i] = rows * width;
+			m_bands[i].ready = false;
+		}
+		m_fp = fopen(filename.c_str(), "wb");
+		if (!m_fp) return;
+		static const unsigned char signature[] = { 0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n' };
+		fwrite(signature, 1, 8, m_fp);
+		unsigned char ihdr[13];
+		Put32(ihdr, width);
+		Put32(ihdr + 4, height);
+		ihdr[8] = 8;		//位深
+		ihdr[9] = 2;		//RGB
+		ihdr[10] = ihdr[11] = ihdr[12] = 0;
+		WriteChunk("IHDR", ihdr, 13);
+	}
+	~PngWriter() { Finish(); }
+	bool IsOpen() { return m_fp != NULL; }
+	//[x0, x1) x [y0, y1)内的像素已经写好，可以在多个线程中同时调用
+	//完成某个行带最后一块的线程负责压缩这个行带
+	void AddRect(int x0, int y0, int x1, int y1)
+	{
+		if (!m_fp) return;
+		for (int y = y0; y < y1; )
+		{
+			int band = y / m_band_rows;
+			int band_end = (band + 1) * m_band_rows < y1 ? (band + 1) * m_band_rows : y1;
+			int pixels = (band_end - y) * (x1 - x0);
+			if ((m_remaining[band] -= pixels) == 0)
+				CompressBand(band);
+			y = band_end;
+		}
+	}
+	//压缩剩余的行带并结束文件，返回是否成功
+	bool Finish()
+	{
+		if (!m_fp) return false;
+		for (int i = 0; i < (int)m_bands.size(); i++)
+			if (m_remaining[i] > 0)
+			{
+				m_remaining[i] = 0;
+				CompressBand(i);
+			}
+		unsigned char adler[4];
+		Put32(adler, m_adler);
+		WriteChunk("IDAT", adler, 4);
+		WriteChunk("IEND", NULL, 0);
+		bool ok = !ferror(m_fp);
+		ok = fclose(m_fp) == 0 && ok;
+		m_fp = NULL;
+		return ok;
+	}
+	//一次写出整幅图像
+	static bool Write(const std::string& filename, const unsigned char* img, int width, int height)
+	{
+		PngWriter png(filename, img, width, height);
+		return png.Finish();
+	}
+};
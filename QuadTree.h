@@ -1,151 +1,175 @@
 #pragma once
 #include <list>
+#include <vector>
+#include <iostream>
+#include "basic.h"
+#include "Stats.h"
 using std::list;
+using std::vector;
 
-#define TREE_DEPTH 3
-#define MIN_NODE_SIZE 0.1
+#define QUADTREE_MAX_DEPTH 8	//最大深度的上限，决定遍历栈的大小，根节点深度为0
+#define MIN_NODE_SIZE 0.1	//边长不超过该值的节点不再划分
 #define SAFE_DELETE(p) do {delete (p); (p)  = NULL;} while (false)  
 
-template<typename T> class QuadNode
+//四叉树节点，所有节点连续存放，用编号代替指针
+struct QuadNode
+{
+	Bound bound;
+	int child[4];	//0:LeftUp, 1:LeftDown, 2:RightUp, 3:RightDown，-1表示没有该子节点
+	int first;		//本节点的entity在m_indices中的起始位置
+	int count;		//本节点的entity数
+};
+
+template<typename T> class QuadTree
 {
 protected:
-	float m_left, m_right, m_up, m_down;
-	list<T*> m_dataList;
-	QuadNode* m_child[4] = { NULL, NULL, NULL, NULL }; //0:LeftUp, 1:LeftDown, 2:RightUp, 3:RightDown
-public:
-	QuadNode(float left, float right, float up, float down) :
-		m_left(left), m_right(right), m_up(up), m_down(down) {}
-	~QuadNode()
-	{
-		for (auto child : m_child)
-			SAFE_DELETE(child);
-	}
-	void SetDataList(list<T*> data) { m_dataList = data; }
-	//递归生成四叉树节点
-	void GenerateNode()
+	//节点和entity编号数组指向自己生成的vector，或者指向映射的缓存文件
+	const QuadNode* m_nodes;		//m_nodes[0]为根节点
+	const int* m_indices;			//所有节点的entity编号，每个节点的连续存放
+	int m_node_count, m_index_count;
+	vector<QuadNode> m_node_storage;
+	vector<int> m_index_storage;
+	vector<T*> m_data;
+	int m_depth;
+	int m_max_depth;
+
+	//递归生成四叉树节点，items为完全处于该节点内的entity，返回节点编号
+	int GenerateNode(Bound bound, vector<int>& items, int depth)
 	{
-		if (m_right - m_left > MIN_NODE_SIZE)
+		int index = (int)m_node_storage.size();
+		m_node_storage.push_back({ bound, { -1, -1, -1, -1 }, 0, 0 });
+		if (depth > m_depth) m_depth = depth;
+		vector<int> child_items[4];
+		if (depth < m_max_depth && bound.right - bound.left > MIN_NODE_SIZE)
 		{
-			m_child[0] = new QuadNode<T>(m_left, (m_left + m_right) / 2.f, m_up, (m_up + m_down) / 2.f);		//LU
-			m_child[1] = new QuadNode<T>(m_left, (m_left + m_right) / 2.f, (m_up + m_down) / 2.f, m_down);		//LD
-			m_child[2] = new QuadNode<T>((m_left + m_right) / 2.f, m_right, m_up, (m_up + m_down) / 2.f);		//RU
-			m_child[3] = new QuadNode<T>((m_left + m_right) / 2.f, m_right, (m_up + m_down) / 2.f, m_down);		//RD
-			for (int i = 0; i < 4; i++)
+			float mid_x = (bound.left + bound.right) / 2.f, mid_y = (bound.up + bound.down) / 2.f;
+			Bound child_bound[4] = {
+				{ bound.left, mid_x, bound.up, mid_y },		//LU
+				{ bound.left, mid_x, mid_y, bound.down },	//LD
+				{ mid_x, bound.right, bound.up, mid_y },	//RU
+				{ mid_x, bound.right, mid_y, bound.down },	//RD
+			};
+			vector<int> rest;
+			for (auto item : items)
 			{
-				list<T*> child_list = {};
-				for (list<T*>::iterator iter = m_dataList.begin(); iter != m_dataList.end();)
+				int i = 0;
+				for (; i < 4; i++)
 				{
-					if ((*iter)->Contained(m_child[i]->m_left, m_child[i]->m_right, m_child[i]->m_up, m_child[i]->m_down))
-					{
-						child_list.push_back(*iter);
-						m_dataList.erase(iter++);
-					}
-					else
-						iter++;
-				}
-				if (child_list.empty())
-				{
-					delete m_child[i];
-					m_child[i] = NULL;
+					Bound& b = child_bound[i];
+					if (m_data[item]->Contained(b.left, b.right, b.up, b.down))
+						break;
 				}
+				if (i < 4)
+					child_items[i].push_back(item);
 				else
-				{	
-					m_child[i]->SetDataList(child_list);
-					m_child[i]->GenerateNode();
-				}
+					rest.push_back(item);
 			}
+			items.swap(rest);
+			m_node_storage[index].first = (int)m_index_storage.size();
+			m_node_storage[index].count = (int)items.size();
+			m_index_storage.insert(m_index_storage.end(), items.begin(), items.end());
+			for (int i = 0; i < 4; i++)
+				if (!child_items[i].empty())		//只保存有entity的子节点
+				{
+					int child = GenerateNode(child_bound[i], child_items[i], depth + 1);
+					m_node_storage[index].child[i] = child;
+				}
 		}
-	}
-	float CalcLineFx(Point p, Vector d, Point s)
-	{
-		return d.y*s.x - d.x*s.y - p.x*d.y + p.y*d.x;
-	}
-	//判断射线与四叉树节点本身包围盒是否相交，用于剪枝
-	bool IntersectBound(Point p, Vector d)
-	{
-		//剪枝1
-		int flag = 0;
-		if(p.x < m_right && p.x > m_left && p.y < m_down && p.y > m_up)		//p在节点内
-			return true;
-		if (p.x < m_left) flag |= 0x01;
-		else if (p.x < m_right) flag |= 0x0A;
-		else flag |= 0x0F;
-		if (p.y < m_up) flag |= 0x10;
-		else if (p.y < m_down) flag |= 0xA0;
-		else flag |= 0xF0;
-		switch (flag)
+		else
 		{
-		case 0x11: if (d.x <= 0.f || d.y <= 0.f)	return false;	break;
-		case 0x1A: if (d.y <= 0.f)					return false;	break;
-		case 0x1F: if (d.x > 0.f || d.y <= 0.f)		return false;	break;
-		case 0xA1: if (d.x <= 0.f)					return false;	break;
-		case 0xAA:									return true; 
-		case 0xAF: if (d.x > 0.f)					return false;	break;
-		case 0xF1: if (d.x <= 0.f || d.y > 0.f)		return false;	break;
-		case 0xFA: if (d.y > 0.f)					return false;	break;
-		case 0xFF: if (d.x > 0.f || d.y > 0.f)		return false;	break;
+			m_node_storage[index].first = (int)m_index_storage.size();
+			m_node_storage[index].count = (int)items.size();
+			m_index_storage.insert(m_index_storage.end(), items.begin(), items.end());
 		}
-		//剪枝2
-		if (CalcLineFx(p, d, { m_left, m_up })*CalcLineFx(p, d, { m_right, m_down }) < 0) return true;
-		if (CalcLineFx(p, d, { m_left, m_down })*CalcLineFx(p, d, { m_right, m_up }) < 0) return true;
-		return false;
+		return index;
 	}
-	//返回该射线相交的最近entity和距离
-	bool Intersect(Point p, Vector d, T* &ent_near, Point& inter, float& dist)
+	void IntersectNode(const QuadNode& node, Point p, Vector d, T* &ent, Point& inter, Vector& normal, float& dist)
 	{
-		if (!IntersectBound(p, d)) return false;
-		for (auto ent : m_dataList)		//首先获取该节点存储的entity中最近的交点
+		for (int i = node.first; i < node.first + node.count; i++)
 		{
+			T* data = m_data[m_indices[i]];
 			Point tmp_inter;
-			if (ent->Intersect(p, d, tmp_inter))
+			Vector tmp_normal;
+			if (data->Intersect(p, d, tmp_inter, tmp_normal))
 			{
 				float tmp_dist = (tmp_inter - p).len();
 				if (dist > tmp_dist)
 				{
-					ent_near = ent;
+					ent = data;
 					dist = tmp_dist;
 					inter = tmp_inter;
+					normal = tmp_normal;
 				}
 			}
 		}
-		for (int i = 0; i < 4; i++)		//再递归比较子节点中的最近交点
-		{
-			QuadNode* node = m_child[i];
-			if (node)		//由于在建树时已经进行了一次剪枝，因此一部分节点为空，不需要计算
-			{
-				T *tmp_ent;
-				Point tmp_inter;
-				float tmp_dist = 10.f;
-				if (node->Intersect(p, d, tmp_ent, tmp_inter, tmp_dist) && tmp_dist < dist)
-				{
-					ent_near = tmp_ent;
-					dist = tmp_dist;
-					inter = tmp_inter;
-				}
-
-			}
-		}
-		if (ent_near) return true;
-		else return false;
 	}
-};
-
-template<typename T> class QuadTree
-{
-protected:
-	QuadNode<T>* m_root;	//根节点
 public:
-	QuadTree(list<T*> data)
+	QuadTree(list<T*> data, int max_depth) : m_data(data.begin(), data.end()), m_depth(0)
+	{
+		m_max_depth = max_depth < QUADTREE_MAX_DEPTH ? max_depth : QUADTREE_MAX_DEPTH;
+		vector<int> items;
+		for (int i = 0; i < (int)m_data.size(); i++)
+			items.push_back(i);
+		GenerateNode({ 0.f, 1.f, 0.f, 1.f }, items, 0);
+		m_nodes = m_node_storage.data();
+		m_indices = m_index_storage.data();
+		m_node_count = (int)m_node_storage.size();
+		m_index_count = (int)m_index_storage.size();
+	}
+	//使用已生成的节点(如映射的缓存文件)，数组由调用者保证在四叉树销毁前有效且已检查过
+	QuadTree(list<T*> data, const QuadNode* nodes, int node_count, const int* indices, int index_count, int depth) :
+		m_nodes(nodes), m_indices(indices), m_node_count(node_count), m_index_count(index_count),
+		m_data(data.begin(), data.end()), m_depth(depth), m_max_depth(depth) {}
+	int GetNodeCount() { return m_node_count; }
+	int GetDepth() { return m_depth; }
+	const QuadNode* GetNodes() { return m_nodes; }
+	const int* GetIndices() { return m_indices; }
+	int GetIndexCount() { return m_index_count; }
+	//节点和entity编号占用的内存(字节)，映射的节点也计算在内
+	size_t GetMemoryUsage()
+	{
+		return m_node_count * sizeof(QuadNode) + m_index_count * sizeof(int) + m_data.size() * sizeof(T*);
+	}
+	void PrintStats(std::ostream& out)
 	{
-		m_root = new QuadNode<T>(0.f, 1.f, 0.f, 1.f);
-		m_root->SetDataList(data);
-		m_root->GenerateNode();
+		out << "quadtree: " << GetNodeCount() << " nodes, depth " << GetDepth() << ", "
+			<< m_nodes[0].count << " entities in root, " << GetMemoryUsage() << " bytes" << std::endl;
 	}
-	void Intersect(Point p, Vector d, T* &ent, Point &inter)
+	//返回射线相交的最近entity、交点和交点处的法向，按射线方向从近到远访问子节点，跳过比当前最近交点更远的节点
+	void Intersect(Point p, Vector d, T* &ent, Point &inter, Vector &normal)
 	{
 		float dist = 10.f;
-		m_root->Intersect(p, d, ent, inter, dist);
+		//根节点的entity可能超出画布(如光源)，总是测试
+		IntersectNode(m_nodes[0], p, d, ent, inter, normal, dist);
+		Vector inv_d = { 1.f / d.x, 1.f / d.y };
+		//射线方向决定子节点的远近顺序：先近的一侧x，再近的一侧y
+		int near_x = d.x >= 0.f ? 0 : 2;
+		int near_y = d.y >= 0.f ? 0 : 1;
+		int order[4] = { near_x | near_y, near_x | (1 - near_y), (2 - near_x) | near_y, (2 - near_x) | (1 - near_y) };
+		int stack[QUADTREE_MAX_DEPTH * 3 + 1];
+		float stack_dist[QUADTREE_MAX_DEPTH * 3 + 1];
+		int top = 0;
+		stack[top] = 0;
+		stack_dist[top++] = 0.f;
+		while (top > 0)
+		{
+			top--;
+			if (stack_dist[top] > dist) continue;
+			const QuadNode& node = m_nodes[stack[top]];
+			STAT_ADD(nodes, 1);
+			if (stack[top] != 0)
+				IntersectNode(node, p, d, ent, inter, normal, dist);
+			//远的先入栈
+			for (int i = 3; i >= 0; i--)
+			{
+				int child = node.child[order[i]];
+				float t_near;
+				if (child >= 0 && m_nodes[child].bound.Intersect(p, inv_d, dist, t_near))
+				{
+					stack[top] = child;
+					stack_dist[top++] = t_near;
+				}
+			}
+		}
 	}
 };
-
-
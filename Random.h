@@ -0,0 +1,30 @@
+#pragma once
+
+//基于计数器的随机数流：由(种子, 像素, 采样序号)唯一确定，不依赖线程调度，也没有全局锁
+class RandomStream
+{
+protected:
+	unsigned int m_key;
+	unsigned int m_counter;
+public:
+	//PCG哈希
+	static unsigned int Hash(unsigned int v)
+	{
+		unsigned int state = v * 747796405u + 2891336453u;
+		unsigned int word = ((state >> ((state >> 28u) + 4u)) ^ state) * 277803737u;
+		return (word >> 22u) ^ word;
+	}
+	RandomStream(unsigned int seed = 0, unsigned int pixel = 0, unsigned int sample = 0) : m_counter(0)
+	{
+		m_key = Hash(seed ^ Hash(pixel ^ Hash(sample)));
+	}
+	unsigned int NextUInt()
+	{
+		return Hash(m_key + Hash(m_counter++));
+	}
+	//[0, 1)之间的均匀分布
+	float Next()
+	{
+		return (NextUInt() >> 8) * (1.f / 16777216.f);
+	}
+};
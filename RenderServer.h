@@ -0,0 +1,311 @@
+// 常驻渲染服务：场景只加载一次，加速结构一直保留，按请求渲染任意视口、分辨率和采样数
+// 请求从标准输入或TCP连接逐行读取，每个连接一个线程，所有请求共用一个线程池
+#pragma once
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+#include <sstream>
+#include <iostream>
+#include <functional>
+#include "Scene.h"
+#include "Renderer.h"
+#include "FrameBuffer.h"
+#include "PngWriter.h"
+#include "Distributed.h"
+
+#define SERVE_MAX_PIXELS (4096 * 4096)	//一次请求的最大像素数，FrameBuffer在渲染前一次分配
+#define SERVE_MAX_ENTITIES 1000000		//请求生成的uniform:n、clustered:n场景的最大实体数
+#define SERVE_MAX_SCENES 8				//同时保留的场景数(含命令行场景)，满了以后去掉最久没用的
+
+//协议，每行一条请求，每条请求回复一行，以ok或error开头：
+//  load scene                        预先加载场景，-表示命令行指定的场景
+//  unload scene                      释放场景，正在用它渲染的请求完成后才真正释放；命令行场景不能释放
+//  render scene x0 y0 x1 y1 width height samples file [seed]
+//                                    渲染场景坐标中[x0, x1) x [y0, y1)的区域，file以.pfm结尾时输出浮点图像，否则输出PNG
+//  场景文件和输出文件都是相对于--serve-dir的路径，不能是绝对路径或含有..
+//  scenes                            列出已加载的场景
+//  quit                              结束当前连接(标准输入时结束服务)
+//  shutdown                          结束服务
+class RenderServer
+{
+protected:
+	ThreadPool* m_pool;
+	RenderSettings m_settings;
+	std::function<Scene*(const std::string&)> m_load;	//按名称创建场景，场景文件相对于m_settings.serve_dir，失败返回NULL
+	struct CachedScene
+	{
+		std::shared_ptr<Scene> scene;	//为空表示正在加载
+		unsigned long long last_use;	//最近一次使用的序号
+	};
+	std::map<std::string, CachedScene> m_scenes;
+	unsigned long long m_uses;
+	std::mutex m_lock;
+	std::condition_variable m_loaded;	//场景加载完成或失败时通知等待它的请求
+	std::mutex m_clients_lock;
+	std::vector<socket_t> m_clients;	//仍然连接着的客户端，shutdown时断开它们
+	std::atomic<bool> m_stop;
+	std::atomic<int> m_requests;
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	//请求中的文件名只能是相对路径，且不能用..跳出serve_dir
+	static bool IsSafePath(const std::string& path)
+	{
+		if (path.empty() || path[0] == '/' || path[0] == '\\' || (path.size() > 1 && path[1] == ':'))
+			return false;
+		size_t start = 0;
+		while (start <= path.size())
+		{
+			size_t end = path.find_first_of("/\\", start);
+			if (end == std::string::npos)
+				end = path.size();
+			if (path.compare(start, end - start, "..") == 0)
+				return false;
+			start = end + 1;
+		}
+		return true;
+	}
+	std::string GetOutputPath(const std::string& file)
+	{
+		const std::string& dir = m_settings.serve_dir;
+		return dir.empty() || dir.back() == '/' || dir.back() == '\\' ? dir + file : dir + "/" + file;
+	}
+	//场景数达到SERVE_MAX_SCENES时去掉最久没用的已加载场景，调用时持有m_lock；没有可以去掉的返回false
+	bool Evict()
+	{
+		while (m_scenes.size() >= SERVE_MAX_SCENES)
+		{
+			auto oldest = m_scenes.end();
+			for (auto it = m_scenes.begin(); it != m_scenes.end(); ++it)
+				if (it->second.scene && it->first != "-" && (oldest == m_scenes.end() || it->second.last_use < oldest->second.last_use))
+					oldest = it;
+			if (oldest == m_scenes.end())
+				return false;
+			m_scenes.erase(oldest);
+		}
+		return true;
+	}
+	//第一次用到时加载并按m_settings建好加速结构，之后直接返回；失败时返回空，原因写入error
+	//加载在锁外进行，不影响其他场景的请求；同一场景同时被请求时只加载一次，其他请求等它完成
+	std::shared_ptr<Scene> GetScene(const std::string& name, double& build_time, std::string& error)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		build_time = 0.0;
+		auto it = m_scenes.find(name);
+		while (it != m_scenes.end() && !it->second.scene)
+		{
+			m_loaded.wait(lock);
+			it = m_scenes.find(name);
+		}
+		if (it != m_scenes.end())
+		{
+			it->second.last_use = ++m_uses;
+			return it->second.scene;
+		}
+		error = "unknown scene " + name;
+		if (!IsSafePath(name))
+			return NULL;
+		if (!Evict())
+		{
+			error = "too many scenes loading";
+			return NULL;
+		}
+		m_scenes[name] = { NULL, ++m_uses };
+		lock.unlock();
+		double start = Now();
+		std::shared_ptr<Scene> s(m_load(name));
+		if (s)
+			s->Configure(m_settings);
+		build_time = Now() - start;
+		lock.lock();
+		if (s)
+			m_scenes[name].scene = s;
+		else
+			m_scenes.erase(name);
+		m_loaded.notify_all();
+		return s;
+	}
+	std::string Render(std::istringstream& args)
+	{
+		std::string name, file;
+		float x0, y0, x1, y1;
+		int width, height, samples;
+		unsigned int seed = m_settings.seed;
+		if (!(args >> name >> x0 >> y0 >> x1 >> y1 >> width >> height >> samples >> file))
+			return "error usage: render scene x0 y0 x1 y1 width height samples file [seed]";
+		args >> seed;
+		if (width <= 0 || height <= 0 || (long long)width * height > SERVE_MAX_PIXELS || samples <= 0 || samples > MAX_SAMPLES)
+			return "error invalid size or samples";
+		if (!IsSafePath(file))
+			return "error invalid output file " + file;
+		double start = Now(), build_time;
+		std::string error;
+		std::shared_ptr<Scene> scene = GetScene(name, build_time, error);
+		if (!scene)
+			return "error " + error;
+		Scene* s = scene.get();	//scene在渲染期间保持场景不被unload或淘汰释放
+		//像素(x, y)对应视口中的(x / width, y / height)，视口为整个单位正方形时与命令行渲染的结果相同
+		FrameBuffer fb(width, height);
+		Renderer renderer(m_pool);
+		float sx = (x1 - x0) / width, sy = (y1 - y0) / height;
+		renderer.Render(fb, [s, x0, y0, sx, sy, width, seed, samples](int x, int y)
+		{
+			return s->Sample({ x0 + x * sx, y0 + y * sy }, y * width + x, seed, samples);
+		});
+		bool ok;
+		std::string path = GetOutputPath(file);
+		if (file.size() > 4 && file.compare(file.size() - 4, 4, ".pfm") == 0)
+			ok = fb.WritePfm(path);
+		else
+		{
+			std::vector<unsigned char> img(width * height * 3);
+			fb.Tonemap(img.data(), m_settings.exposure, m_settings.gamma);
+			ok = PngWriter::Write(path.c_str(), img.data(), width, height);
+		}
+		if (!ok)
+			return "error cannot write " + file;
+		m_requests++;
+		std::ostringstream out;
+		out << "ok " << width << "x" << height << " " << samples << " samples, render " << renderer.GetWallTime() << "s, total " << Now() - start << "s";
+		if (build_time > 0.0)
+			out << ", scene build " << build_time << "s";
+		return out.str();
+	}
+	//处理一行请求，返回回复；quit为true时结束当前连接
+	std::string Handle(const std::string& line, bool& quit)
+	{
+		std::istringstream args(line);
+		std::string command;
+		quit = false;
+		if (!(args >> command))
+			return "error empty request";
+		if (command == "render")
+			return Render(args);
+		if (command == "load")
+		{
+			std::string name, error;
+			double build_time;
+			if (!(args >> name))
+				return "error usage: load scene";
+			std::shared_ptr<Scene> s = GetScene(name, build_time, error);
+			if (!s)
+				return "error " + error;
+			std::ostringstream out;
+			out << "ok " << s->GetEntities().size() << " entities, build " << build_time << "s";
+			return out.str();
+		}
+		if (command == "unload")
+		{
+			std::string name;
+			if (!(args >> name))
+				return "error usage: unload scene";
+			std::lock_guard<std::mutex> guard(m_lock);
+			auto it = m_scenes.find(name);
+			if (it == m_scenes.end() || !it->second.scene || name == "-")
+				return "error cannot unload " + name;
+			m_scenes.erase(it);
+			return "ok";
+		}
+		if (command == "scenes")
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			std::string out = "ok";
+			for (auto& it : m_scenes)
+				if (it.second.scene)
+					out += " " + it.first;
+			return out;
+		}
+		if (command == "quit" || command == "shutdown")
+		{
+			quit = true;
+			if (command == "shutdown")
+				m_stop = true;
+			return "ok";
+		}
+		return "error unknown command " + command;
+	}
+	void ServeConnection(socket_t s)
+	{
+		std::string line;
+		bool quit = false;
+		while (!quit && DistSocket::RecvLine(s, line))
+		{
+			std::string reply = Handle(line, quit) + "\n";
+			if (!DistSocket::SendAll(s, reply.data(), reply.size()))
+				break;
+		}
+		//先从列表中去掉再关闭，Serve不会对已关闭(可能被复用)的socket调用Shutdown
+		{
+			std::lock_guard<std::mutex> guard(m_clients_lock);
+			m_clients.erase(std::find(m_clients.begin(), m_clients.end(), s));
+		}
+		DistSocket::Close(s);
+	}
+public:
+	//scene为命令行指定的场景，注册为"-"；load用来创建其他场景，它们都按settings配置
+	RenderServer(ThreadPool* pool, const RenderSettings& settings, Scene* scene, std::function<Scene*(const std::string&)> load) :
+		m_pool(pool), m_settings(settings), m_load(load), m_uses(0), m_stop(false), m_requests(0)
+	{
+		//命令行指定的场景由调用者释放
+		m_scenes["-"] = { std::shared_ptr<Scene>(scene, [](Scene*) {}), 0 };
+	}
+	//逐行处理in中的请求，直到quit、shutdown或输入结束
+	void Serve(std::istream& in, std::ostream& out)
+	{
+		std::string line;
+		bool quit = false;
+		while (!quit && std::getline(in, line))
+		{
+			if (!line.empty() && line.back() == '\r')
+				line.pop_back();
+			out << Handle(line, quit) << std::endl;
+		}
+	}
+	//在address的port上接受连接，每个连接一个线程，直到收到shutdown；0表示由系统选择端口，实际端口写入out
+	//协议没有认证，address默认只接受本机连接
+	bool Serve(int port, std::ostream& out, const std::string& address = "127.0.0.1")
+	{
+		DistSocket::Startup();
+		socket_t listener = DistSocket::Listen(port, address);
+		if (listener == INVALID_SOCKET)
+			return false;
+		out << "listening on " << address << ":" << port << std::endl;
+		std::vector<std::thread> connections;
+		while (!m_stop)
+		{
+			std::string name;
+			if (!DistSocket::WaitReadable(listener, 1))
+				continue;
+			socket_t s = DistSocket::Accept(listener, name);
+			if (s != INVALID_SOCKET)
+			{
+				std::lock_guard<std::mutex> guard(m_clients_lock);
+				m_clients.push_back(s);
+				connections.push_back(std::thread(&RenderServer::ServeConnection, this, s));
+			}
+		}
+		DistSocket::Close(listener);
+		//其他连接可能空闲地阻塞在RecvLine中，断开后它们的线程才能结束；正在渲染的请求会先完成
+		{
+			std::lock_guard<std::mutex> guard(m_clients_lock);
+			for (socket_t s : m_clients)
+				DistSocket::Shutdown(s);
+		}
+		for (auto& t : connections)
+			t.join();
+		return true;
+	}
+	void PrintStats(std::ostream& out)
+	{
+		out << "server: " << m_requests << " requests, " << m_scenes.size() << " scenes" << std::endl;
+	}
+};
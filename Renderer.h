@@ -0,0 +1,189 @@
+#pragma once
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <iostream>
+#include <functional>
+#include "basic.h"
+#include "ThreadPool.h"
+#include "FrameBuffer.h"
+#include "Trace.h"
+
+#define TILE_SIZE 32
+#define ADAPTIVE_MIN_PASS 4		//至少采样的轮数，用来估计方差
+#define ADAPTIVE_MAX_PASS 16		//最多采样的轮数
+#define ADAPTIVE_THRESHOLD 0.05f	//均值的相对标准误差小于该值时停止
+#define ADAPTIVE_MIN_LUMINANCE 0.01f	//暗像素按该亮度计算相对误差，避免在几乎全黑的地方反复采样
+
+struct Tile
+{
+	int x0, y0, x1, y1;		//[x0, x1) x [y0, y1)
+};
+
+//把图像切成tile交给线程池并行渲染
+class Renderer
+{
+protected:
+	ThreadPool* m_pool;
+	int m_tile_size;
+	std::vector<int> m_tile_count;		//每个线程渲染的tile数
+	std::vector<double> m_busy_time;	//每个线程渲染tile所用的时间
+	double m_wall_time;
+	int m_pixels;
+	std::function<void(const Tile&)> m_on_tile;		//每个tile完成后在渲染它的线程中调用
+	ThreadPool::TaskGroup m_group;		//只等待自己的tile，多个Renderer可以同时使用一个线程池
+
+	static double Now()
+	{
+		return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+public:
+	Renderer(ThreadPool* pool, int tile_size = TILE_SIZE) :
+		m_pool(pool), m_tile_size(tile_size), m_wall_time(0.0), m_pixels(0) {}
+	//用于在渲染过程中处理已完成的部分，如边渲染边压缩PNG
+	void SetTileCallback(std::function<void(const Tile&)> on_tile) { m_on_tile = on_tile; }
+	static void WriteColor(unsigned char* p, Color color)
+	{
+		p[0] = (int)fminf(color.r *255.0f, 255.0f);
+		p[1] = (int)fminf(color.g *255.0f, 255.0f);
+		p[2] = (int)fminf(color.b *255.0f, 255.0f);
+	}
+	//热力图颜色，t从0到1依次为黑、蓝、青、绿、黄、红
+	static Color HeatColor(float t)
+	{
+		static Color colors[] = { { 0.f, 0.f, 0.f }, { 0.f, 0.f, 1.f }, { 0.f, 1.f, 1.f }, { 0.f, 1.f, 0.f }, { 1.f, 1.f, 0.f }, { 1.f, 0.f, 0.f } };
+		const int n = sizeof(colors) / sizeof(colors[0]) - 1;
+		t = fminf(fmaxf(t, 0.f), 1.f) * n;
+		int i = std::min((int)t, n - 1);
+		float f = t - i;
+		return colors[i] * (1.f - f) + colors[i + 1] * f;
+	}
+	//把每个像素的采样轮数画成热力图，按max_count归一化
+	static void WriteHeatmap(unsigned char* img, const int* counts, int width, int height, int max_count)
+	{
+		for (int i = 0; i < width * height; i++)
+			WriteColor(img + i * 3, HeatColor((float)counts[i] / max_count));
+	}
+	std::vector<Tile> GenerateTiles(int width, int height)
+	{
+		std::vector<Tile> tiles;
+		for (int y = 0; y < height; y += m_tile_size)
+			for (int x = 0; x < width; x += m_tile_size)
+				tiles.push_back({ x, y, std::min(x + m_tile_size, width), std::min(y + m_tile_size, height) });
+		return tiles;
+	}
+	//对每个像素调用shader(x, y)得到颜色，累加到fb中，多次调用可以累加多轮
+	//stride > 1时只渲染x和y都是stride倍数的像素，用于渐进预览
+	template<typename Shader> void Render(FrameBuffer& fb, Shader shader, int stride = 1)
+	{
+		int width = fb.GetWidth(), height = fb.GetHeight();
+		int n = m_pool->GetThreadCount() + 1;
+		m_tile_count.assign(n, 0);
+		m_busy_time.assign(n, 0.0);
+		m_pixels = ((width + stride - 1) / stride) * ((height + stride - 1) / stride);
+		TraceScope trace("render");
+		double start = Now();
+		for (auto tile : GenerateTiles(width, height))
+		{
+			m_pool->Submit([this, tile, stride, &fb, &shader]()
+			{
+				TraceScope trace("tile", tile.x0, tile.y0);
+				double t0 = Now();
+				for (int y = (tile.y0 + stride - 1) / stride * stride; y < tile.y1; y += stride)
+					for (int x = (tile.x0 + stride - 1) / stride * stride; x < tile.x1; x += stride)
+						fb.Add(x, y, shader(x, y));
+				int index = m_pool->GetWorkerIndex();
+				m_tile_count[index]++;
+				m_busy_time[index] += Now() - t0;
+				if (m_on_tile)
+					m_on_tile(tile);
+			}, m_group);
+		}
+		m_pool->Wait(m_group);
+		m_wall_time = Now() - start;
+	}
+	//自适应采样：shader(x, y, pass)返回第pass轮的采样结果，各轮相互独立
+	//每个像素按各轮亮度的均值和方差判断是否收敛，方差取tile内3x3邻域中最大的一个，
+	//这样偶尔才能采到光源的像素不会因为前几轮恰好全黑而提前停止；每个像素的采样轮数记在fb的采样次数中
+	template<typename Shader> void RenderAdaptive(FrameBuffer& fb, Shader shader)
+	{
+		int width = fb.GetWidth(), height = fb.GetHeight();
+		int n = m_pool->GetThreadCount() + 1;
+		m_tile_count.assign(n, 0);
+		m_busy_time.assign(n, 0.0);
+		m_pixels = width * height;
+		TraceScope trace("render");
+		double start = Now();
+		for (auto tile : GenerateTiles(width, height))
+		{
+			m_pool->Submit([this, tile, &fb, &shader]()
+			{
+				TraceScope trace("tile", tile.x0, tile.y0);
+				double t0 = Now();
+				int tw = tile.x1 - tile.x0, th = tile.y1 - tile.y0, count = tw * th;
+				std::vector<Color> sum(count, { 0.f, 0.f, 0.f });
+				std::vector<float> mean(count, 0.f), m2(count, 0.f), var(count, 0.f);
+				std::vector<int> pass(count, 0);
+				std::vector<bool> done(count, false);
+				int active = count;
+				for (int k = 0; k < ADAPTIVE_MAX_PASS && active > 0; k++)
+				{
+					for (int i = 0; i < count; i++)
+					{
+						if (done[i]) continue;
+						Color c = shader(tile.x0 + i % tw, tile.y0 + i / tw, k);
+						sum[i] = sum[i] + c;
+						pass[i]++;
+						float lum = (c.r + c.g + c.b) / 3.f;
+						float delta = lum - mean[i];
+						mean[i] += delta / pass[i];
+						m2[i] += delta * (lum - mean[i]);
+					}
+					if (k + 1 < ADAPTIVE_MIN_PASS) continue;
+					for (int i = 0; i < count; i++)
+						var[i] = m2[i] / (pass[i] - 1);
+					for (int i = 0; i < count; i++)
+					{
+						if (done[i]) continue;
+						int x = i % tw, y = i / tw;
+						float v = 0.f;
+						for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, th - 1); ny++)
+							for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, tw - 1); nx++)
+								v = fmaxf(v, var[ny * tw + nx]);
+						if (sqrtf(v / pass[i]) <= ADAPTIVE_THRESHOLD * fmaxf(mean[i], ADAPTIVE_MIN_LUMINANCE))
+						{
+							done[i] = true;
+							active--;
+						}
+					}
+				}
+				for (int i = 0; i < count; i++)
+					fb.Add(tile.x0 + i % tw, tile.y0 + i / tw, sum[i], pass[i]);
+				int index = m_pool->GetWorkerIndex();
+				m_tile_count[index]++;
+				m_busy_time[index] += Now() - t0;
+				if (m_on_tile)
+					m_on_tile(tile);
+			}, m_group);
+		}
+		m_pool->Wait(m_group);
+		m_wall_time = Now() - start;
+	}
+	double GetWallTime() { return m_wall_time; }
+	//并行效率：所有线程忙碌时间之和 / (墙钟时间 * 线程数)
+	double GetEfficiency()
+	{
+		double busy = 0.0;
+		for (auto t : m_busy_time)
+			busy += t;
+		return m_wall_time > 0.0 ? busy / (m_wall_time * m_pool->GetThreadCount()) : 0.0;
+	}
+	void PrintStats(std::ostream& out)
+	{
+		out << "threads: " << m_pool->GetThreadCount() << ", time: " << m_wall_time << "s, "
+			<< m_pixels / m_wall_time << " pixels/s, efficiency: " << GetEfficiency() * 100.0 << "%" << std::endl;
+		for (size_t i = 0; i < m_tile_count.size(); i++)
+			if (m_tile_count[i])
+				out << "  thread " << i << ": " << m_tile_count[i] << " tiles, " << m_busy_time[i] << "s" << std::endl;
+	}
+};
@@ -1,17 +1,23 @@
 #pragma once
-#include <stdlib.h> // rand(), RAND_MAX
 #include "Shape.h"
+#include "Random.h"
+#include "Spectrum.h"
 #include "QuadTree.h"
+#include "BVH.h"
+#include "Grid.h"
+#include "AccelCache.h"
+#include "Settings.h"
+#include "Stats.h"
+#include "Trace.h"
 
 using namespace std;
 
-#define MAX_DEPTH 5
-#define IS_DEBUG false
-#define N 16
-#define N2 16
 #define TWO_PI 6.28318530718f
 #define BIAS 1e-4f
-#define USE_QUADTREE false
+#define USE_FRESNEL false		//路径追踪时按Fresnel项在反射和折射间分配能量
+#define RR_DEPTH 3				//从该深度开始进行Russian roulette
+#define PATH_MAX_DEPTH 64		//路径的最大深度
+#define MAX_NEE_LIGHTS 64		//向光源采样时最多考虑的光源数，其余的光源只能被均匀采样找到
 
 void drawLine(Point p1, Point p2);
 
@@ -22,37 +28,75 @@ protected:
 	Color m_emissive;
 	float m_reflectivity;		//不考虑漫反射
 	float m_refractivity;		//一般的，要求reflectivity + refractivity <= 1
-	float m_refract_index[N2];	//认为每种颜色可以有不同的折射率
+	float m_refract_index[3];	//红绿蓝三种颜色的折射率，其他颜色线性插值
+	float m_bin_index[MAX_SPECTRUM_BINS];	//光谱每一段的折射率，由SetSpectrumBins计算
+	int m_bins;
 public:
 	Entity(Shape* s, Color e, float re = 0.f, float ra = 0.f, float* ri = NULL) :
 		m_shape(s), m_emissive(e), m_reflectivity(re), m_refractivity(ra)
 	{
-		if (ri)
-			for (int i = 0; i < 3; i++)
-				m_refract_index[i] = ri[i];
+		for (int i = 0; i < 3; i++)
+			m_refract_index[i] = ri ? ri[i] : 1.f;
+		SetSpectrumBins(N2);
 	}
 	Entity(Shape* s, Color e, float re, float ra, float ri_min, float ri_max) :
 		m_shape(s), m_emissive(e), m_reflectivity(re), m_refractivity(ra)
 	{
-		for (int i = 0; i < N2; i++)
-			m_refract_index[i] = (ri_max - ri_min) / (N2 - 1) * i + ri_min;
+		m_refract_index[0] = ri_min;
+		m_refract_index[1] = (ri_min + ri_max) / 2.f;
+		m_refract_index[2] = ri_max;
+		SetSpectrumBins(N2);
 	}
 	~Entity() { SAFE_DELETE(m_shape); }
 	Shape* GetShape() { return m_shape; }
 	Color GetEmissive() { return m_emissive; }
 	float GetReflectivity() { return m_reflectivity; }
 	float GetRefractivity() { return m_refractivity; }
-	float GetRefractIndex(int index) { return m_refract_index[index]; }
+	//把光谱分为bins段，按红绿蓝三种颜色的折射率插值出每一段的折射率
+	void SetSpectrumBins(int bins)
+	{
+		m_bins = bins;
+		for (int i = 0; i < bins; i++)
+		{
+			float t = 2.f * i / (bins - 1);
+			int k = t < 1.f ? 0 : 1;
+			m_bin_index[i] = m_refract_index[k] + (m_refract_index[k + 1] - m_refract_index[k]) * (t - k);
+		}
+	}
+	//index >= m_bins表示尚未分光的白光，只在IsDispersive()为false时使用
+	float GetRefractIndex(int index) { return m_bin_index[index < m_bins ? index : 0]; }
+	//各颜色的折射率是否不同
+	bool IsDispersive() { return m_refract_index[0] != m_refract_index[1] || m_refract_index[1] != m_refract_index[2]; }
 	//判断是否相交并返回交点
 	virtual bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_ADD(tests, 1);
 		return m_shape->Intersect(p, d, inter);
 	}
+	//判断是否相交并返回交点和交点处的法向
+	virtual bool Intersect(Point p, Vector d, Point &inter, Vector &normal)
+	{
+		STAT_ADD(tests, 1);
+		return m_shape->Intersect(p, d, inter, normal);
+	}
 	//判断是否在包围盒内部
 	bool Contained(float left, float right, float up, float down)
 	{
 		return m_shape->Contained(left, right, up, down);
 	}
+	//获取包围盒，无界时返回false
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		return m_shape->GetBound(left, right, up, down);
+	}
+	//射线包求交，见Shape::IntersectPacket
+	virtual void IntersectPacket(Point p, const float* dx, const float* dy, int n, float* dist)
+	{
+		STAT_ADD(tests, n);
+		m_shape->IntersectPacket(p, dx, dy, n, dist);
+	}
+	//发光方向的范围：主方向dir和半角angle，向各个方向发光时返回false
+	virtual bool GetEmissionCone(Vector& dir, float& angle) { return false; }
 };
 
 //聚光灯
@@ -71,16 +115,58 @@ public:
 	~SpotLight() {}
 	bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_ADD(tests, 1);
 		if (d*(-m_dir) < m_cosa)	//预过滤角度方向在照射范围外的光线
 			return false;
 		else
 			return m_shape->Intersect(p, d, inter);
 	}
+	bool Intersect(Point p, Vector d, Point &inter, Vector &normal)
+	{
+		STAT_ADD(tests, 1);
+		if (d*(-m_dir) < m_cosa)
+			return false;
+		else
+			return m_shape->Intersect(p, d, inter, normal);
+	}
+	void IntersectPacket(Point p, const float* dx, const float* dy, int n, float* dist)
+	{
+		STAT_ADD(tests, n);
+		m_shape->IntersectPacket(p, dx, dy, n, dist);
+		for (int i = 0; i < n; i++)
+			if (-(dx[i] * m_dir.x + dy[i] * m_dir.y) < m_cosa)
+				dist[i] = PACKET_MISS;
+	}
+	bool GetEmissionCone(Vector& dir, float& angle)
+	{
+		dir = m_dir;
+		angle = acosf(m_cosa);
+		return true;
+	}
+};
+
+//编译期确定的渲染参数，Scene中追踪光线的函数按它实例化，BINS和DEPTH成为常量后循环和判断可以在编译时展开
+//BINS或DEPTH为0时使用运行时RenderSettings中的值，DEBUG只在调试时使用，避免在正常渲染中判断是否画线
+template<int BINS_, int DEPTH_, AccelType ACCEL_, bool DEBUG_ = false> struct KernelConfig
+{
+	static const int BINS = BINS_;
+	static const int DEPTH = DEPTH_;
+	static const AccelType ACCEL = ACCEL_;
+	static const bool DEBUG = DEBUG_;
 };
 
 class Scene
 {
 protected:
+	typedef Color(Scene::*SampleFunc)(Point p, unsigned int pixel, unsigned int seed, int samples);
+	struct SampleKernel
+	{
+		int bins;
+		int depth;
+		AccelType accel;
+		bool debug;
+		SampleFunc func;
+	};
 	Color rainbow[7] =
 	{
 		{ 1.f,0.f,0.f },
@@ -92,22 +178,138 @@ protected:
 		{ 0.55f,0.f,1.f },
 	};
 	QuadTree<Entity>* m_entityTree;
+	BVH<Entity>* m_entityBVH;
+	UniformGrid<Entity>* m_entityGrid;
+	AccelCache m_accelCache;		//设置了accel_cache时，加速结构可能直接指向这里映射的文件
+	Spectrum m_spectrum;
 	list<Entity*> m_entities;		//依然保留entity列表，用于调试
+	vector<Entity*> m_entityArray;	//射线包求交时按编号访问entity
+	vector<Entity*> m_emitters;		//有界的自发光entity，向光源采样时使用
+	RenderSettings m_settings;
+	SampleFunc m_sample;			//按m_settings从分派表中选出的Sample实例
+	bool m_specialized;				//m_sample的BINS和DEPTH是否为常量
+	double m_buildTime;				//上次构建加速结构的时间(秒)
+
+	//分派表：常用的参数组合各实例化一份，最后是参数都取运行时值的通用版本和调试版本
+	static const SampleKernel* GetSampleKernels(int& count)
+	{
+#define SAMPLE_KERNEL(bins, depth, accel, debug) { bins, depth, accel, debug, &Scene::Sample<KernelConfig<bins, depth, accel, debug>> }
+#define SAMPLE_KERNELS(bins, depth, debug) SAMPLE_KERNEL(bins, depth, ACCEL_LIST, debug), SAMPLE_KERNEL(bins, depth, ACCEL_QUADTREE, debug), SAMPLE_KERNEL(bins, depth, ACCEL_BVH, debug), SAMPLE_KERNEL(bins, depth, ACCEL_GRID, debug)
+		static const SampleKernel kernels[] =
+		{
+			SAMPLE_KERNELS(16, 5, false),
+			SAMPLE_KERNELS(8, 5, false),
+			SAMPLE_KERNELS(32, 5, false),
+			SAMPLE_KERNELS(16, 10, false),
+			SAMPLE_KERNELS(8, 10, false),
+			SAMPLE_KERNELS(32, 10, false),
+			SAMPLE_KERNELS(0, 0, false),
+			SAMPLE_KERNELS(0, 0, true),
+		};
+#undef SAMPLE_KERNELS
+#undef SAMPLE_KERNEL
+		count = sizeof(kernels) / sizeof(kernels[0]);
+		return kernels;
+	}
+	template<typename K> int GetBins() { return K::BINS > 0 ? K::BINS : m_settings.bins; }
+	template<typename K> int GetMaxDepth() { return K::DEPTH > 0 ? K::DEPTH : m_settings.max_depth; }
 public:
-	Scene(list<Entity*> entities):m_entities(entities)
+	Scene(list<Entity*> entities, const RenderSettings& settings = RenderSettings()) :
+		m_entityTree(NULL), m_entityBVH(NULL), m_entityGrid(NULL), m_entities(entities), m_entityArray(entities.begin(), entities.end()), m_buildTime(0.0)
 	{
-		m_entityTree = new QuadTree<Entity>(entities);
+		for (auto ent : m_entities)
+		{
+			Color e = ent->GetEmissive();
+			float left, right, up, down;
+			if (e.r + e.g + e.b > 0.f && ent->GetBound(left, right, up, down) && (int)m_emitters.size() < MAX_NEE_LIGHTS)
+				m_emitters.push_back(ent);
+		}
+		Configure(settings);
 	}
 	~Scene()
 	{
 		delete m_entityTree;
+		delete m_entityBVH;
+		delete m_entityGrid;
 		for (auto ent : m_entities)
 			SAFE_DELETE(ent);
 	}
+	//应用新的渲染参数：重建需要的加速结构，重新选择Sample的实例
+	void Configure(const RenderSettings& settings)
+	{
+		//加速结构只与entity和这几个参数有关，不变时保留原来的
+		bool rebuild = (!m_entityTree && !m_entityBVH && !m_entityGrid) || settings.accel != m_settings.accel
+			|| settings.tree_depth != m_settings.tree_depth || settings.accel_cache != m_settings.accel_cache;
+		m_settings = settings;
+		m_settings.samples = min(max(m_settings.samples, 1), MAX_SAMPLES);
+		m_settings.light_samples = min(max(m_settings.light_samples, 0), MAX_SAMPLES - m_settings.samples);
+		m_settings.bins = min(max(m_settings.bins, 2), MAX_SPECTRUM_BINS);
+		for (auto ent : m_entities)
+			ent->SetSpectrumBins(m_settings.bins);
+		if (rebuild)
+		{
+			SAFE_DELETE(m_entityTree);
+			SAFE_DELETE(m_entityBVH);
+			SAFE_DELETE(m_entityGrid);
+			m_accelCache.Close();
+			TraceScope trace("accelerator build");
+			auto start = chrono::steady_clock::now();
+			const string& cache = m_settings.accel_cache;
+			if (m_settings.accel == ACCEL_QUADTREE)
+				m_entityTree = cache.empty() ? new QuadTree<Entity>(m_entities, m_settings.tree_depth) : m_accelCache.GetQuadTree(cache, m_entities, m_settings.tree_depth);
+			else if (m_settings.accel == ACCEL_BVH)
+				m_entityBVH = cache.empty() ? new BVH<Entity>(m_entities) : m_accelCache.GetBVH(cache, m_entities);
+			else if (m_settings.accel == ACCEL_GRID)
+				m_entityGrid = new UniformGrid<Entity>(m_entities);		//构建只需一遍，不写缓存
+			m_buildTime = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+		}
+		if (m_settings.hero)
+		{
+			//找不到CIE表时退回到与N2路分支相同的彩虹色
+			if (!m_spectrum.Load("ciexyz31.csv", m_settings.bins))
+				for (int i = 0; i < m_settings.bins; i++)
+					m_spectrum.SetWeight(i, GetRefractColor(i, m_settings.bins) * 2.f);
+		}
+		int count;
+		const SampleKernel* kernels = GetSampleKernels(count);
+		for (int i = 0; i < count; i++)
+		{
+			const SampleKernel& k = kernels[i];
+			if (k.accel != m_settings.accel || k.debug != m_settings.debug) continue;
+			if (k.bins == 0 || (k.bins == m_settings.bins && k.depth == m_settings.max_depth))
+			{
+				m_sample = k.func;
+				m_specialized = k.bins != 0;
+				break;
+			}
+		}
+	}
+	const RenderSettings& GetSettings() { return m_settings; }
+	//只修改每个像素的采样数，不重建加速结构，用于渐进预览
+	void SetSamples(int samples)
+	{
+		m_settings.samples = min(max(samples, 1), MAX_SAMPLES - m_settings.light_samples);
+	}
+	bool IsSpecialized() { return m_specialized; }
 	list<Entity*> GetEntities() { return m_entities; }
-	Color GetRefractColor(int index)
+	QuadTree<Entity>* GetEntityTree() { return m_entityTree; }
+	UniformGrid<Entity>* GetEntityGrid() { return m_entityGrid; }
+	double GetBuildTime() { return m_buildTime; }
+	//当前加速结构占用的内存(字节)，逐个测试时只有entity指针数组
+	size_t GetAccelMemoryUsage()
+	{
+		switch (m_settings.accel)
+		{
+		case ACCEL_QUADTREE: return m_entityTree->GetMemoryUsage();
+		case ACCEL_BVH: return m_entityBVH->GetMemoryUsage();
+		case ACCEL_GRID: return m_entityGrid->GetMemoryUsage();
+		default: return m_entityArray.size() * sizeof(Entity*);
+		}
+	}
+	AccelCache& GetAccelCache() { return m_accelCache; }
+	Color GetRefractColor(int index, int bins)
 	{
-		float idxf = index * 6.f / (N2 - 1);
+		float idxf = index * 6.f / (bins - 1);
 		float idx1 = floor(idxf);
 		float idx2 = ceil(idxf);
 		float gap1 = idxf - idx1;
@@ -122,16 +324,16 @@ public:
 		};
 		return color;
 	}
-	Color Refract(Entity* ent, Point inter, Vector d, Vector normal, int color_index, int depth)
+	//计算折射方向，全反射时返回false
+	bool GetRefractDirection(Entity* ent, Vector d, Vector normal, int color_index, Vector& refract)
 	{
-		if (depth > MAX_DEPTH || ent->GetRefractivity() == 0.f) return{ 0.f, 0.f,0.f };
 		float idotn = d * normal;
 		float ri = ent->GetRefractIndex(color_index);
 		float k, a;
 		if (idotn > 0.f)	//从内向外折射
 		{
 			k = 1.f - ri*ri*(1.f - idotn*idotn);
-			if (k < 0.f) return{ 0.f, 0.f, 0.f };  //全反射
+			if (k < 0.f) return false;  //全反射
 			a = ri * idotn - sqrtf(k);
 		}
 		else  //从外向内折射
@@ -140,79 +342,358 @@ public:
 			k = 1.f - ri*ri*(1.f - idotn*idotn);
 			a = ri * idotn + sqrtf(k);
 		}
-		Vector refract = d*ri - normal*a;
-		return GetColor(inter + refract * BIAS, refract, color_index, depth) * ent->GetRefractivity();
+		refract = d*ri - normal*a;
+		return true;
+	}
+	//Schlick近似的Fresnel反射率
+	float GetFresnel(Entity* ent, Vector d, Vector normal, int color_index)
+	{
+		float cosi = fabsf(d * normal);
+		float ri = ent->GetRefractIndex(color_index);
+		float r0 = (ri - 1.f) / (ri + 1.f);
+		r0 = r0 * r0;
+		return r0 + (1.f - r0) * powf(1.f - cosi, 5.f);
 	}
-	Color Reflect(Entity* ent, Point inter, Vector d, Vector normal, int color_index, int depth)
+	template<typename K> Color Refract(Entity* ent, Point inter, Vector d, Vector normal, int color_index, int depth)
 	{
-		if (depth > MAX_DEPTH || ent->GetReflectivity() == 0.f) return{ 0.f, 0.f,0.f };
+		if (depth > GetMaxDepth<K>() || ent->GetRefractivity() == 0.f) return{ 0.f, 0.f,0.f };
+		Vector refract;
+		if (!GetRefractDirection(ent, d, normal, color_index, refract)) return{ 0.f, 0.f, 0.f };
+		return GetColor<K>(inter + refract * BIAS, refract, color_index, depth) * ent->GetRefractivity();
+	}
+	template<typename K> Color Reflect(Entity* ent, Point inter, Vector d, Vector normal, int color_index, int depth)
+	{
+		if (depth > GetMaxDepth<K>() || ent->GetReflectivity() == 0.f) return{ 0.f, 0.f,0.f };
 		//if (normal * d > 0.f) return{ 0.f, 0.f,0.f };
 		Vector reflect = d.reflect(normal);
-		return GetColor(inter + reflect * BIAS, reflect, color_index, depth) * ent->GetReflectivity();
+		return GetColor<K>(inter + reflect * BIAS, reflect, color_index, depth) * ent->GetReflectivity();
 	}
-	Color GetColor(Point p, Vector d, int color_index, int depth = 0)	//获取p点从d方向收到的emissive
+	//求射线最近的交点和交点处的法向，没有相交时返回NULL，depth只用于统计
+	template<typename K> Entity* FindNearest(Point p, Vector d, Point& inter, Vector& normal, int depth = 0)
 	{
-		Color trace_emissive{ 0.0f, 0.0f, 0.0f };
-		float distance = 10.0f;
 		Entity* ent_near = NULL;
-		Point inter;
-#if USE_QUADTREE
-		m_entityTree->Intersect(p, d, ent_near, inter);
-#else
-		for (auto ent:m_entities)
+		STAT_RAYS(depth, 1);
+		if (K::ACCEL == ACCEL_BVH)
+			m_entityBVH->Intersect(p, d, ent_near, inter, normal);
+		else if (K::ACCEL == ACCEL_QUADTREE)
+			m_entityTree->Intersect(p, d, ent_near, inter, normal);
+		else if (K::ACCEL == ACCEL_GRID)
+			m_entityGrid->Intersect(p, d, ent_near, inter, normal);
+		else
 		{
-			Point tmp_inter;
-			if (ent->Intersect(p, d, tmp_inter))
+			float distance = 10.0f;
+			for (auto ent : m_entities)
 			{
-				float new_dist = (tmp_inter - p).len();
-				if (distance > new_dist)
+				Point tmp_inter;
+				Vector tmp_normal;
+				if (ent->Intersect(p, d, tmp_inter, tmp_normal))
 				{
-					ent_near = ent;
-					distance = new_dist;
-					inter = tmp_inter;
+					float new_dist = (tmp_inter - p).len();
+					if (distance > new_dist)
+					{
+						ent_near = ent;
+						distance = new_dist;
+						inter = tmp_inter;
+						normal = tmp_normal;
+					}
 				}
 			}
 		}
-#endif // USE_QUADTREE
-		
+		if (!ent_near)
+			STAT_ADD(misses, 1);
+		return ent_near;
+	}
+	//按m_settings.accel选择加速结构
+	Entity* FindNearest(Point p, Vector d, Point& inter, Vector& normal)
+	{
+		switch (m_settings.accel)
+		{
+		case ACCEL_BVH: return FindNearest<KernelConfig<0, 0, ACCEL_BVH>>(p, d, inter, normal);
+		case ACCEL_QUADTREE: return FindNearest<KernelConfig<0, 0, ACCEL_QUADTREE>>(p, d, inter, normal);
+		case ACCEL_GRID: return FindNearest<KernelConfig<0, 0, ACCEL_GRID>>(p, d, inter, normal);
+		default: return FindNearest<KernelConfig<0, 0, ACCEL_LIST>>(p, d, inter, normal);
+		}
+	}
+	//从p出发沿d的射线在inter处与ent_near相交，normal为交点处的法向，计算交点的自发光、反射和折射
+	template<typename K> Color Shade(Entity* ent_near, Point p, Point inter, Vector normal, Vector d, int color_index, int depth)
+	{
+		const int bins = GetBins<K>();
+		if (K::DEBUG)
+			drawLine(p, inter);
+		Color reflect = Reflect<K>(ent_near, inter, d, normal, color_index, depth + 1);
+		Color refract = { 0.f, 0.f, 0.f };
+		if (color_index > bins)
+		{
+			//白光，但已为该路径选定了波长段color_index - bins - 1，色散时只追踪这一段
+			int hero = color_index - bins - 1;
+			if (ent_near->IsDispersive())
+				refract = Refract<K>(ent_near, inter, d, normal, hero, depth + 1) * m_spectrum.GetWeight(hero);
+			else
+				refract = Refract<K>(ent_near, inter, d, normal, color_index, depth + 1);
+		}
+		else if (color_index == bins)
+		{
+			STAT_ADD(splits, 1);
+			//refract.r = Refract(ent_near, inter, d, normal, 0, depth + 1).r;
+			//refract.g = Refract(ent_near, inter, d, normal, 1, depth + 1).g;
+			//refract.b = Refract(ent_near, inter, d, normal, 2, depth + 1).b;
+//#pragma omp parallel for
+			for (int i = 0; i < bins; i++)
+				refract = refract + Refract<K>(ent_near, inter, d, normal, i, depth + 1) * GetRefractColor(i, bins);
+			refract = refract * 2.f / bins;
+		}
+		else
+			refract = Refract<K>(ent_near, inter, d, normal, color_index, depth + 1);
+		return ent_near->GetEmissive() + reflect + refract;
+	}
+	template<typename K> Color GetColor(Point p, Vector d, int color_index, int depth = 0)	//获取p点从d方向收到的emissive
+	{
+		Point inter;
+		Vector normal;
+		Entity* ent_near = FindNearest<K>(p, d, inter, normal, depth);
 		if (ent_near)
+			return Shade<K>(ent_near, p, inter, normal, d, color_index, depth);
+		else
+			return{ 0.0f, 0.0f, 0.0f };
+	}
+	//从p出发的n条射线一起与所有entity求交，nearest[i]为最近entity的编号，不相交为-1
+	void IntersectPacket(Point p, const float* dx, const float* dy, int n, int* nearest)
+	{
+		float dist[PACKET_SIZE], tmp[PACKET_SIZE];
+		for (int i = 0; i < n; i++)
 		{
-			if (IS_DEBUG)
+			dist[i] = 10.f;
+			nearest[i] = -1;
+		}
+		for (int k = 0; k < (int)m_entityArray.size(); k++)
+		{
+			m_entityArray[k]->IntersectPacket(p, dx, dy, n, tmp);
+			NearestPacket(tmp, k, n, dist, nearest);
+		}
+	}
+	//从p出发沿d的射线在inter处与ent相交，交点处的法向为normal，用循环追踪一条路径：
+	//每次相交累加自发光，再按反射率和折射率随机选择一个方向继续，用throughput记录剩余的能量
+	template<typename K> Color TracePath(Entity* ent, Point p, Point inter, Vector normal, Vector d, int color_index, RandomStream& rng)
+	{
+		const int bins = GetBins<K>();
+		Color sum = { 0.f, 0.f, 0.f };
+		Color throughput = { 1.f, 1.f, 1.f };
+		for (int depth = 0; ent; depth++)
+		{
+			if (K::DEBUG)
 				drawLine(p, inter);
-			Vector normal = ent_near->GetShape()->GetNormal(inter);
-			Color reflect = Reflect(ent_near, inter, d, normal, color_index, depth + 1);
-			Color refract = { 0.f, 0.f, 0.f };
-			if (color_index >= N2)
+			sum = sum + throughput * ent->GetEmissive();
+			if (depth >= PATH_MAX_DEPTH) break;
+			float reflectivity = ent->GetReflectivity();
+			float refractivity = ent->GetRefractivity();
+			int refract_index = color_index;
+			Color spectral = { 1.f, 1.f, 1.f };
+			if (refractivity > 0.f)
 			{
-				//refract.r = Refract(ent_near, inter, d, normal, 0, depth + 1).r;
-				//refract.g = Refract(ent_near, inter, d, normal, 1, depth + 1).g;
-				//refract.b = Refract(ent_near, inter, d, normal, 2, depth + 1).b;
-//#pragma omp parallel for
-				for (int i = 0; i < N2; i++)
-					refract = refract + Refract(ent_near, inter, d, normal, i, depth + 1) * GetRefractColor(i);
-				refract = refract * 2.f / N2;
+				//白光折射时随机选一个颜色，权重与递归版本的分支一致
+				if (color_index > bins && ent->IsDispersive())
+				{
+					refract_index = color_index - bins - 1;
+					spectral = m_spectrum.GetWeight(refract_index);
+				}
+				else if (color_index == bins)
+				{
+					refract_index = min((int)(rng.Next() * bins), bins - 1);
+					spectral = GetRefractColor(refract_index, bins) * 2.f;
+				}
+			}
+			Vector refract = d;
+			bool can_refract = refractivity > 0.f && GetRefractDirection(ent, d, normal, refract_index, refract);
+#if USE_FRESNEL
+			if (refractivity > 0.f)
+			{
+				float fresnel = can_refract ? GetFresnel(ent, d, normal, refract_index) : 1.f;
+				reflectivity += refractivity * fresnel;
+				refractivity *= 1.f - fresnel;
 			}
+#endif
+			if (!can_refract)
+				refractivity = 0.f;
+			float total = reflectivity + refractivity;
+			if (total <= 0.f) break;
+			if (rng.Next() * total < reflectivity)
+				d = d.reflect(normal);
 			else
-				refract = Refract(ent_near, inter, d, normal, color_index, depth + 1);
-			return ent_near->GetEmissive() + reflect + refract;
+			{
+				d = refract;
+				color_index = refract_index;
+				throughput = throughput * spectral;
+			}
+			throughput = throughput * total;
+			//Russian roulette：以剩余能量为概率继续，存活时补偿能量
+			if (depth + 1 >= RR_DEPTH)
+			{
+				float q = fminf(fmaxf(throughput.r, fmaxf(throughput.g, throughput.b)), 1.f);
+				if (rng.Next() >= q) break;
+				throughput = throughput / q;
+			}
+			p = inter + d * BIAS;
+			ent = FindNearest<K>(p, d, inter, normal, depth + 1);
 		}
+		return sum;
+	}
+	//首次相交之后的颜色
+	template<typename K> Color GetHitColor(Entity* ent, Point p, Point inter, Vector normal, Vector d, int color_index, RandomStream& rng)
+	{
+		if (m_settings.path_tracer)
+			return TracePath<K>(ent, p, inter, normal, d, color_index, rng);
 		else
-			return{ 0.0f, 0.0f, 0.0f };
+			return Shade<K>(ent, p, inter, normal, d, color_index, 0);
+	}
+	//从某点看一个光源的方向范围，用光源包围盒的外接圆近似
+	struct LightCone
+	{
+		float center;		//中心方向的角度
+		float half;			//半张角，点在外接圆内时为PI
+		float prob;			//选中该光源的概率
+	};
+	//按亮度乘张角分配各光源被选中的概率，返回光源数
+	int GetLightCones(Point p, LightCone* cones)
+	{
+		float total = 0.f;
+		int n = 0;
+		for (auto ent : m_emitters)
+		{
+			float left, right, up, down;
+			ent->GetBound(left, right, up, down);
+			Vector v = { (left + right) / 2.f - p.x, (up + down) / 2.f - p.y };
+			float radius = sqrtf((right - left) * (right - left) + (down - up) * (down - up)) / 2.f;
+			float dist = v.len();
+			LightCone& c = cones[n++];
+			c.center = atan2f(v.y, v.x);
+			c.half = dist > radius ? asinf(radius / dist) : TWO_PI / 2.f;
+			Color e = ent->GetEmissive();
+			c.prob = (e.r + e.g + e.b) * c.half;
+			total += c.prob;
+		}
+		for (int i = 0; i < n; i++)
+			cones[i].prob /= total;
+		return n;
+	}
+	//向光源采样时方向a的概率密度
+	float GetLightPdf(const LightCone* cones, int n, float a)
+	{
+		float pdf = 0.f;
+		for (int i = 0; i < n; i++)
+		{
+			float diff = fabsf(remainderf(a - cones[i].center, TWO_PI));
+			if (diff <= cones[i].half)
+				pdf += cones[i].prob / (2.f * cones[i].half);
+		}
+		return pdf;
+	}
+	//先按概率选一个光源，再在它的张角内均匀选方向
+	float SampleLightDirection(const LightCone* cones, int n, RandomStream& rng)
+	{
+		float u = rng.Next();
+		int i = 0;
+		while (i < n - 1 && u >= cones[i].prob)
+			u -= cones[i++].prob;
+		return cones[i].center + (rng.Next() * 2.f - 1.f) * cones[i].half;
+	}
+	//为每个采样分配初始颜色编号，bins表示白光
+	//hero时为bins + 1 + 波长段，各采样的波长段分层覆盖整个光谱，并随机打乱以免与方向相关
+	template<typename K> void GetSampleColorIndex(unsigned int pixel, unsigned int seed, int samples, int* color_index)
+	{
+		const int bins = GetBins<K>();
+		for (int i = 0; i < samples; i++)
+			color_index[i] = bins;
+		if (!m_settings.hero)
+			return;
+		RandomStream rng(seed, pixel, samples);
+		int strata[MAX_SAMPLES];
+		for (int i = 0; i < samples; i++)
+			strata[i] = i;
+		for (int i = samples - 1; i > 0; i--)
+			swap(strata[i], strata[rng.NextUInt() % (i + 1)]);
+		for (int i = 0; i < samples; i++)
+			color_index[i] = bins + 1 + min((int)((strata[i] + rng.Next()) * bins / samples), bins - 1);
 	}
-	Color Sample(Point p)
+	//pixel和seed决定随机数流，同样的参数总是得到同样的结果
+	//light_samples > 0时另外向光源采样，与均匀采样按balance heuristic组合：
+	//两种采样中方向a的结果都乘以1 / (N + 2PI * M * pdf_light(a))，没有光源采样时即为1 / N
+	template<typename K> Color Sample(Point p, unsigned int pixel, unsigned int seed, int samples)
 	{
 		Color sum{ 0.0f, 0.0f, 0.0f };
-		Color tmp[N];
-#pragma omp parallel for
-		for (int i = 0; i < N; i++)
+		int color_index[MAX_SAMPLES];
+		LightCone cones[MAX_NEE_LIGHTS];
+		const int light_samples = m_emitters.empty() ? 0 : m_settings.light_samples;
+		const int lights = light_samples > 0 ? GetLightCones(p, cones) : 0;
+		const float nee_scale = TWO_PI * light_samples;
+		GetSampleColorIndex<K>(pixel, seed, samples + light_samples, color_index);
+		for (int first = 0; first < samples; first += PACKET_SIZE)
 		{
-			float a = TWO_PI * (i + (float)rand() / RAND_MAX) / N;
-			//float a = TWO_PI * (i) / N;
-			tmp[i] = GetColor(p, { cosf(a), sinf(a) }, N2);
+			int n = min(PACKET_SIZE, samples - first);
+			float dx[PACKET_SIZE], dy[PACKET_SIZE], weight[PACKET_SIZE];
+			RandomStream rng[PACKET_SIZE];
+			for (int i = 0; i < n; i++)
+			{
+				rng[i] = RandomStream(seed, pixel, first + i);
+				float a = TWO_PI * (first + i + rng[i].Next()) / samples;
+				//float a = TWO_PI * (first + i) / samples;
+				dx[i] = cosf(a);
+				dy[i] = sinf(a);
+				weight[i] = lights ? 1.f / (samples + nee_scale * GetLightPdf(cones, lights, a)) : 1.f / samples;
+			}
+			if (K::ACCEL == ACCEL_LIST && m_settings.packet)
+			{
+				int nearest[PACKET_SIZE];
+				STAT_RAYS(0, n);
+				IntersectPacket(p, dx, dy, n, nearest);
+				for (int i = 0; i < n; i++)
+				{
+					if (nearest[i] < 0)
+					{
+						STAT_ADD(misses, 1);
+						continue;
+					}
+					//交点位置仍用标量求交计算，保证与GetColor的结果一致
+					Entity* ent = m_entityArray[nearest[i]];
+					Point inter;
+					Vector normal;
+					if (ent->Intersect(p, { dx[i], dy[i] }, inter, normal))
+						sum = sum + GetHitColor<K>(ent, p, inter, normal, { dx[i], dy[i] }, color_index[first + i], rng[i]) * weight[i];
+				}
+			}
+			else
+			{
+				for (int i = 0; i < n; i++)
+				{
+					Point inter;
+					Vector normal;
+					Entity* ent = FindNearest<K>(p, { dx[i], dy[i] }, inter, normal);
+					if (ent)
+						sum = sum + GetHitColor<K>(ent, p, inter, normal, { dx[i], dy[i] }, color_index[first + i], rng[i]) * weight[i];
+				}
+			}
+		}
+		for (int j = 0; j < light_samples; j++)
+		{
+			RandomStream rng(seed, pixel, samples + j);
+			float a = SampleLightDirection(cones, lights, rng);
+			Vector d = { cosf(a), sinf(a) };
+			Point inter;
+			Vector normal;
+			Entity* ent = FindNearest<K>(p, d, inter, normal);
+			if (ent)
+				sum = sum + GetHitColor<K>(ent, p, inter, normal, d, color_index[samples + j], rng) / (samples + nee_scale * GetLightPdf(cones, lights, a));
 		}
-		for (int i = 0; i < N; i++)
-			sum = sum + tmp[i];
-		return sum / N;
+		return sum;
+	}
+	//使用Configure时选出的实例
+	Color Sample(Point p, unsigned int pixel = 0, unsigned int seed = 0)
+	{
+		return (this->*m_sample)(p, pixel, seed, m_settings.samples);
+	}
+	//指定每个像素的采样数，不修改场景的设置，多个调用者可以用不同的采样数同时渲染同一场景
+	Color Sample(Point p, unsigned int pixel, unsigned int seed, int samples)
+	{
+		return (this->*m_sample)(p, pixel, seed, min(max(samples, 1), MAX_SAMPLES - m_settings.light_samples));
 	}
 	Color GetBaseColor(Point p)
 	{
@@ -221,4 +702,26 @@ public:
 				return ent->GetEmissive();
 		return{ 0.f, 0.f, 0.f };
 	}
-};
\ No newline at end of file
+	//降噪的导向信息：覆盖p的entity编号(没有为-1)和它的自发光，以及dirs个均匀方向上首次相交距离的平均值(最多为1)
+	void GetGuide(Point p, int dirs, int& id, Color& base, float& dist)
+	{
+		id = -1;
+		base = { 0.f, 0.f, 0.f };
+		for (int k = 0; k < (int)m_entityArray.size(); k++)
+			if (m_entityArray[k]->GetShape()->IsInside(p))
+			{
+				id = k;
+				base = m_entityArray[k]->GetEmissive();
+				break;
+			}
+		dist = 0.f;
+		for (int i = 0; i < dirs; i++)
+		{
+			float a = TWO_PI * (i + 0.5f) / dirs;
+			Point inter;
+			Vector normal;
+			dist += FindNearest(p, { cosf(a), sinf(a) }, inter, normal) ? fminf((inter - p).len(), 1.f) : 1.f;
+		}
+		dist /= dirs;
+	}
+};
@@ -0,0 +1,345 @@
+// 场景描述文件：文本格式便于手写，首次读取后另存一份二进制缓存，之后直接映射到内存使用
+#pragma once
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <map>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <sys/stat.h>
+#include "MappedFile.h"
+#include "Scene.h"
+
+//文本格式，每行一条语句，#之后为注释，shape先命名再被引用：
+//  circle name x y r
+//  line name a b c                 半平面a*x + b*y + c >= 0
+//  polygon name x1 y1 x2 y2 ...    凸多边形
+//  union|intersect|substract name shape1 shape2
+//  entity shape r g b [reflect f] [refract f] [index r g b]
+//  spotlight shape r g b [reflect f] [refract f] [index r g b] [dir x y] [angle a]
+//同一个shape可以被引用多次，每次引用生成一份独立的对象
+
+#define SCENE_FILE_MAGIC 0x4e435332u	//"2SCN"
+#define SCENE_FILE_VERSION 2
+
+enum SceneShapeType
+{
+	SCENE_SHAPE_CIRCLE,
+	SCENE_SHAPE_LINE,
+	SCENE_SHAPE_POLYGON,
+	SCENE_SHAPE_UNION,
+	SCENE_SHAPE_INTERSECT,
+	SCENE_SHAPE_SUBSTRACT,
+};
+
+//shape节点，组合shape引用编号更小的节点
+struct SceneShapeRecord
+{
+	int32_t type;
+	int32_t arg0, arg1;		//组合shape的两个子节点；多边形在顶点数组中的起始位置和顶点数
+	float v[3];				//圆：x, y, r；直线：a, b, c
+};
+
+struct SceneEntityRecord
+{
+	int32_t shape;
+	int32_t spotlight;
+	float emissive[3];
+	float reflectivity, refractivity;
+	float refract_index[3];
+	float dir[2];			//聚光灯主方向
+	float angle;			//聚光灯角度范围
+};
+
+//二进制缓存的文件头，后面依次是shape、顶点和entity数组
+struct SceneFileHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t shape_count;
+	uint32_t point_count;
+	uint32_t entity_count;
+	uint32_t reserved;
+	uint64_t text_size;		//生成缓存时文本文件的大小和修改时间，与当前的文本不一致时缓存失效
+	int64_t text_mtime;
+};
+
+//三个平铺的数组，可以指向自己的vector，也可以直接指向映射的文件
+struct SceneDesc
+{
+	const SceneShapeRecord* shapes;
+	const Point* points;
+	const SceneEntityRecord* entities;
+	int shape_count, point_count, entity_count;
+};
+
+class SceneFile
+{
+protected:
+	std::vector<SceneShapeRecord> m_shapes;
+	std::vector<Point> m_points;
+	std::vector<SceneEntityRecord> m_entities;
+	MappedFile m_mapped;
+	SceneDesc m_desc;
+	std::string m_error;
+
+	bool Fail(int line, const std::string& message)
+	{
+		m_error = "line " + std::to_string(line) + ": " + message;
+		return false;
+	}
+	void UseVectors()
+	{
+		m_desc = { m_shapes.data(), m_points.data(), m_entities.data(),
+			(int)m_shapes.size(), (int)m_points.size(), (int)m_entities.size() };
+	}
+	Shape* BuildShape(int index)
+	{
+		const SceneShapeRecord& r = m_desc.shapes[index];
+		switch (r.type)
+		{
+		case SCENE_SHAPE_CIRCLE: return new Circle({ r.v[0], r.v[1] }, r.v[2]);
+		case SCENE_SHAPE_LINE: return new Line(r.v[0], r.v[1], r.v[2]);
+		case SCENE_SHAPE_POLYGON: return new ConvexPolygon(std::vector<Point>(m_desc.points + r.arg0, m_desc.points + r.arg0 + r.arg1));
+		case SCENE_SHAPE_UNION: return new ShapeUnion(BuildShape(r.arg0), BuildShape(r.arg1));
+		case SCENE_SHAPE_INTERSECT: return new ShapeIntersect(BuildShape(r.arg0), BuildShape(r.arg1));
+		case SCENE_SHAPE_SUBSTRACT: return new ShapeSubstract(BuildShape(r.arg0), BuildShape(r.arg1));
+		}
+		return NULL;
+	}
+	//检查引用是否越界，映射的文件可能已损坏
+	bool Validate()
+	{
+		for (int i = 0; i < m_desc.shape_count; i++)
+		{
+			const SceneShapeRecord& r = m_desc.shapes[i];
+			if (r.type < SCENE_SHAPE_CIRCLE || r.type > SCENE_SHAPE_SUBSTRACT)
+				return false;
+			if (r.type == SCENE_SHAPE_POLYGON && (r.arg0 < 0 || r.arg1 < 3 || r.arg0 + r.arg1 > m_desc.point_count
+				|| ConvexPolygon::CountEdges(m_desc.points + r.arg0, r.arg1) < 3))
+				return false;
+			if (r.type >= SCENE_SHAPE_UNION && (r.arg0 < 0 || r.arg0 >= i || r.arg1 < 0 || r.arg1 >= i))
+				return false;
+		}
+		for (int i = 0; i < m_desc.entity_count; i++)
+			if (m_desc.entities[i].shape < 0 || m_desc.entities[i].shape >= m_desc.shape_count)
+				return false;
+		return true;
+	}
+public:
+	SceneFile() { UseVectors(); }
+	const std::string& GetError() { return m_error; }
+	const SceneDesc& GetDesc() { return m_desc; }
+	//解析文本格式
+	bool ParseText(const std::string& filename)
+	{
+		std::ifstream file(filename);
+		if (!file)
+		{
+			m_error = "cannot open " + filename;
+			return false;
+		}
+		m_shapes.clear();
+		m_points.clear();
+		m_entities.clear();
+		m_mapped.Close();
+		std::map<std::string, int> names;
+		std::string text;
+		for (int line = 1; std::getline(file, text); line++)
+		{
+			size_t comment = text.find('#');
+			if (comment != std::string::npos)
+				text.resize(comment);
+			std::istringstream in(text);
+			std::string cmd, name;
+			if (!(in >> cmd))
+				continue;
+			if (cmd == "entity" || cmd == "spotlight")
+			{
+				SceneEntityRecord e = { 0, cmd == "spotlight", { 0.f, 0.f, 0.f }, 0.f, 0.f, { 1.f, 1.f, 1.f }, { 0.f, 1.f }, 0.03f };
+				if (!(in >> name >> e.emissive[0] >> e.emissive[1] >> e.emissive[2]))
+					return Fail(line, "expected shape name and emissive color");
+				if (!names.count(name))
+					return Fail(line, "unknown shape " + name);
+				e.shape = names[name];
+				std::string key;
+				while (in >> key)
+				{
+					bool ok;
+					if (key == "reflect") ok = (bool)(in >> e.reflectivity);
+					else if (key == "refract") ok = (bool)(in >> e.refractivity);
+					else if (key == "index") ok = (bool)(in >> e.refract_index[0] >> e.refract_index[1] >> e.refract_index[2]);
+					else if (key == "dir" && e.spotlight) ok = (bool)(in >> e.dir[0] >> e.dir[1]);
+					else if (key == "angle" && e.spotlight) ok = (bool)(in >> e.angle);
+					else return Fail(line, "unknown property " + key);
+					if (!ok)
+						return Fail(line, "bad value for " + key);
+				}
+				m_entities.push_back(e);
+				continue;
+			}
+			SceneShapeRecord r = { 0, 0, 0, { 0.f, 0.f, 0.f } };
+			if (!(in >> name))
+				return Fail(line, "expected shape name");
+			if (cmd == "circle" || cmd == "line")
+			{
+				r.type = cmd == "circle" ? SCENE_SHAPE_CIRCLE : SCENE_SHAPE_LINE;
+				if (!(in >> r.v[0] >> r.v[1] >> r.v[2]))
+					return Fail(line, "expected 3 numbers");
+			}
+			else if (cmd == "polygon")
+			{
+				r.type = SCENE_SHAPE_POLYGON;
+				r.arg0 = (int)m_points.size();
+				Point p;
+				while (in >> p.x >> p.y)
+					m_points.push_back(p);
+				r.arg1 = (int)m_points.size() - r.arg0;
+				if (r.arg1 < 3)
+					return Fail(line, "polygon needs at least 3 points");
+				if (ConvexPolygon::CountEdges(&m_points[r.arg0], r.arg1) < 3)
+					return Fail(line, "polygon needs at least 3 edges of nonzero length");
+			}
+			else if (cmd == "union" || cmd == "intersect" || cmd == "substract")
+			{
+				r.type = cmd == "union" ? SCENE_SHAPE_UNION : (cmd == "intersect" ? SCENE_SHAPE_INTERSECT : SCENE_SHAPE_SUBSTRACT);
+				std::string s1, s2;
+				if (!(in >> s1 >> s2) || !names.count(s1) || !names.count(s2))
+					return Fail(line, "expected two defined shapes");
+				r.arg0 = names[s1];
+				r.arg1 = names[s2];
+			}
+			else
+				return Fail(line, "unknown statement " + cmd);
+			names[name] = (int)m_shapes.size();
+			m_shapes.push_back(r);
+		}
+		UseVectors();
+		return true;
+	}
+	//文件大小和修改时间，时间的单位为纳秒(Windows为100纳秒)，秒级的时间分辨不出同一秒内的修改
+	static bool GetFileStamp(const std::string& filename, uint64_t& size, int64_t& mtime)
+	{
+#ifdef _WIN32
+		WIN32_FILE_ATTRIBUTE_DATA data;
+		if (!GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &data))
+			return false;
+		size = ((uint64_t)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+		mtime = (int64_t)(((uint64_t)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime);
+#else
+		struct stat st;
+		if (stat(filename.c_str(), &st) != 0)
+			return false;
+		size = (uint64_t)st.st_size;
+#ifdef __APPLE__
+		mtime = (int64_t)st.st_mtimespec.tv_sec * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+		mtime = (int64_t)st.st_mtim.tv_sec * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#endif
+		return true;
+	}
+	//保存为二进制缓存，text_size和text_mtime为解析前文本文件的状态
+	//先写临时文件再改名，其他进程映射着的旧缓存不会被改写
+	bool WriteBinary(const std::string& filename, uint64_t text_size, int64_t text_mtime)
+	{
+		std::string tmp = filename + ".tmp" + std::to_string(std::chrono::steady_clock::now().time_since_epoch().count());
+		FILE* fp = fopen(tmp.c_str(), "wb");
+		if (!fp) return false;
+		SceneFileHeader header = { SCENE_FILE_MAGIC, SCENE_FILE_VERSION,
+			(uint32_t)m_desc.shape_count, (uint32_t)m_desc.point_count, (uint32_t)m_desc.entity_count, 0, text_size, text_mtime };
+		bool ok = fwrite(&header, sizeof(header), 1, fp) == 1;
+		ok = ok && fwrite(m_desc.shapes, sizeof(SceneShapeRecord), m_desc.shape_count, fp) == (size_t)m_desc.shape_count;
+		ok = ok && fwrite(m_desc.points, sizeof(Point), m_desc.point_count, fp) == (size_t)m_desc.point_count;
+		ok = ok && fwrite(m_desc.entities, sizeof(SceneEntityRecord), m_desc.entity_count, fp) == (size_t)m_desc.entity_count;
+		ok = fclose(fp) == 0 && ok;
+#ifdef _WIN32
+		if (ok && MoveFileExA(tmp.c_str(), filename.c_str(), MOVEFILE_REPLACE_EXISTING))
+#else
+		if (ok && rename(tmp.c_str(), filename.c_str()) == 0)
+#endif
+			return true;
+		remove(tmp.c_str());
+		return false;
+	}
+	//映射二进制缓存，数组直接指向映射的内存，不做复制；缓存记录的文本状态与参数不同时失败
+	bool MapBinary(const std::string& filename, uint64_t text_size, int64_t text_mtime)
+	{
+		if (!m_mapped.Open(filename))
+		{
+			m_error = "cannot map " + filename;
+			return false;
+		}
+		const char* data = m_mapped.GetData();
+		SceneFileHeader header;
+		memset(&header, 0, sizeof(header));
+		if (m_mapped.GetSize() >= sizeof(header))
+			memcpy(&header, data, sizeof(header));
+		size_t size = sizeof(header) + header.shape_count * sizeof(SceneShapeRecord)
+			+ header.point_count * sizeof(Point) + header.entity_count * sizeof(SceneEntityRecord);
+		if (header.magic != SCENE_FILE_MAGIC || header.version != SCENE_FILE_VERSION || size != m_mapped.GetSize())
+		{
+			m_mapped.Close();
+			m_error = "invalid cache " + filename;
+			return false;
+		}
+		if (header.text_size != text_size || header.text_mtime != text_mtime)
+		{
+			m_mapped.Close();
+			m_error = "stale cache " + filename;
+			return false;
+		}
+		const char* p = data + sizeof(header);
+		m_desc.shapes = (const SceneShapeRecord*)p;
+		p += header.shape_count * sizeof(SceneShapeRecord);
+		m_desc.points = (const Point*)p;
+		p += header.point_count * sizeof(Point);
+		m_desc.entities = (const SceneEntityRecord*)p;
+		m_desc.shape_count = header.shape_count;
+		m_desc.point_count = header.point_count;
+		m_desc.entity_count = header.entity_count;
+		if (!Validate())
+		{
+			m_mapped.Close();
+			UseVectors();
+			m_error = "corrupted cache " + filename;
+			return false;
+		}
+		return true;
+	}
+	//读取filename，优先使用由当前文本生成的filename.bin，没有时解析文本并写出缓存
+	bool Load(const std::string& filename)
+	{
+		std::string cache = filename + ".bin";
+		uint64_t text_size;
+		int64_t text_mtime;
+		bool stamped = GetFileStamp(filename, text_size, text_mtime);
+		if (stamped && MapBinary(cache, text_size, text_mtime))
+			return true;
+		if (!ParseText(filename))
+			return false;
+		if (stamped)
+			WriteBinary(cache, text_size, text_mtime);		//写不了缓存时下次仍解析文本
+		return true;
+	}
+	//按描述创建所有entity
+	Scene* CreateScene(const RenderSettings& settings = RenderSettings())
+	{
+		list<Entity*> entities;
+		for (int i = 0; i < m_desc.entity_count; i++)
+		{
+			const SceneEntityRecord& e = m_desc.entities[i];
+			Color emissive = { e.emissive[0], e.emissive[1], e.emissive[2] };
+			float refract[3] = { e.refract_index[0], e.refract_index[1], e.refract_index[2] };
+			Shape* shape = BuildShape(e.shape);
+			if (e.spotlight)
+				entities.push_back(new SpotLight(shape, emissive, e.reflectivity, e.refractivity, refract, { e.dir[0], e.dir[1] }, e.angle));
+			else
+				entities.push_back(new Entity(shape, emissive, e.reflectivity, e.refractivity, refract));
+		}
+		return new Scene(entities, settings);
+	}
+};
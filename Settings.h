@@ -0,0 +1,227 @@
+#pragma once
+#include <string>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <sstream>
+#include <stdint.h>
+
+//以下宏只是RenderSettings的默认值，都可以用命令行参数在运行时修改
+#define W 512
+#define H 512
+#define SEED 0
+#define N 16				//每个像素的采样数
+#define N2 16				//光谱分段数
+#define MAX_DEPTH 5
+#define TREE_DEPTH 3		//四叉树最大深度，根节点深度为0
+#define IS_DEBUG false
+#define USE_QUADTREE false
+#define USE_BVH false		//优先于USE_QUADTREE
+#define USE_GRID false		//均匀网格，优先于USE_BVH
+#define USE_PACKET true		//首次求交使用SIMD射线包
+#define USE_HERO_WAVELENGTH false	//每条路径只随机追踪一个波长，代替N2路的折射分支
+#define USE_PATH_TRACER false	//用循环代替Reflect/Refract的递归，随机选择反射或折射
+#define USE_ADAPTIVE false		//自适应采样：每个像素逐轮采样，直到收敛或达到ADAPTIVE_MAX_PASS轮
+#define EXPOSURE 1.f		//色调映射前乘上的曝光
+#define GAMMA 1.f			//输出时的gamma，1表示线性输出
+#define LIGHT_SAMPLES 0		//每个像素另外向光源采样的方向数，与均匀采样按MIS组合
+#define USE_LIGHT_TRACER false	//从光源出发追踪光子，代替从像素出发的采样，适合焦散和色散为主的场景
+#define USE_PROGRESSIVE false	//先按1/2^PROGRESSIVE_LEVELS的分辨率和较少的采样数输出预览，再逐级细化
+#define PROGRESSIVE_LEVELS 3
+#define USE_DENOISER false	//渲染后用entity编号、自发光和首次相交距离作为导向做边缘保持的降噪
+#define DIST_WORKERS 0		//在本机启动的worker进程数，大于0时本进程只负责分配tile和合并结果
+#define LISTEN_ADDRESS "127.0.0.1"	//--listen的默认地址，只接受本机的连接
+#define LIGHT_PATHS 16		//光线追踪模式下平均每个像素从光源发出的光路数
+#define MAX_SAMPLES 1024	//每个像素采样数的上限，决定Sample中栈上数组的大小
+#define MAX_SPECTRUM_BINS 64	//光谱分段数的上限
+
+enum AccelType
+{
+	ACCEL_LIST,			//逐个测试所有entity
+	ACCEL_QUADTREE,
+	ACCEL_BVH,
+	ACCEL_GRID,			//均匀网格，适合大量均匀分布的entity
+	ACCEL_NUM
+};
+
+inline const char* GetAccelName(AccelType accel)
+{
+	static const char* names[] = { "list", "quadtree", "bvh", "grid" };
+	return accel < ACCEL_NUM ? names[accel] : "unknown";
+}
+
+//渲染参数，由命令行参数解析得到，传给Scene和Renderer
+struct RenderSettings
+{
+	int width, height;
+	unsigned int seed;
+	int samples;		//每个像素的采样数
+	int light_samples;	//每个像素向光源采样的方向数
+	int bins;			//光谱分段数
+	int max_depth;		//递归追踪的最大深度
+	int tree_depth;		//四叉树最大深度
+	AccelType accel;
+	bool debug;
+	bool packet;
+	bool hero;
+	bool path_tracer;
+	bool adaptive;
+	bool light_trace;
+	bool progressive;
+	bool denoise;
+	bool serve;			//常驻服务，按请求渲染，不输出reflect.png
+	int light_paths;	//光线追踪模式下平均每个像素从光源发出的光路数
+	int threads;		//线程池的线程数，0表示与CPU核数相同
+	int workers;		//在本机启动的worker进程数
+	int port;			//分布式渲染时协调进程监听的端口，0表示由系统选择
+	std::string listen_address;	//--listen监听的地址(分布式渲染和--serve)，默认只接受本机连接，0.0.0.0表示所有网卡
+	std::string worker;	//非空时作为worker连接host:port上的协调进程
+	bool sweep;			//依次渲染多种分辨率和采样数并输出时间
+	bool scaling;		//依次用1, 2, 4...个线程渲染并输出加速比
+	bool simd_bench;	//在内置场景上比较各指令集的射线包求交速度
+	int passes;			//渲染的轮数，每轮换一个种子，结果累加
+	float exposure;
+	float gamma;
+	std::string scene;	//场景名，空表示默认场景
+	std::string trace;	//Chrome trace输出文件，空表示不记录
+	std::string hdr;	//PFM输出文件，空表示不输出
+	std::string tonemap;	//不渲染，只把这个PFM文件重新做色调映射
+	std::string accel_cache;	//加速结构缓存文件的目录，空表示每次重新构建
+	std::string serve_dir;		//--serve的请求只能读写这个目录中的文件，空表示当前目录
+
+	RenderSettings() :
+		width(W), height(H), seed(SEED), samples(N), light_samples(LIGHT_SAMPLES), bins(N2), max_depth(MAX_DEPTH), tree_depth(TREE_DEPTH),
+		accel(USE_GRID ? ACCEL_GRID : (USE_BVH ? ACCEL_BVH : (USE_QUADTREE ? ACCEL_QUADTREE : ACCEL_LIST))),
+		debug(IS_DEBUG), packet(USE_PACKET), hero(USE_HERO_WAVELENGTH), path_tracer(USE_PATH_TRACER),
+		adaptive(USE_ADAPTIVE), light_trace(USE_LIGHT_TRACER), progressive(USE_PROGRESSIVE), denoise(USE_DENOISER), serve(false), light_paths(LIGHT_PATHS), threads(0), workers(DIST_WORKERS), port(0), listen_address(LISTEN_ADDRESS), sweep(false), scaling(false), simd_bench(false), passes(1), exposure(EXPOSURE), gamma(GAMMA) {}
+
+	static void PrintUsage(std::ostream& out, const char* name)
+	{
+		out << "usage: " << name << " [options]" << std::endl
+			<< "  --width n, --height n    image size (" << W << "x" << H << ")" << std::endl
+			<< "  --samples n              samples per pixel (" << N << ", at most " << MAX_SAMPLES << ")" << std::endl
+			<< "  --light-samples n        extra samples toward emitters per pixel (" << LIGHT_SAMPLES << ")" << std::endl
+			<< "  --bins n                 spectrum bins (" << N2 << ", at most " << MAX_SPECTRUM_BINS << ")" << std::endl
+			<< "  --depth n                max trace depth (" << MAX_DEPTH << ")" << std::endl
+			<< "  --tree-depth n           quadtree depth (" << TREE_DEPTH << ")" << std::endl
+			<< "  --seed n                 random seed (" << SEED << ")" << std::endl
+			<< "  --accel list|quadtree|bvh|grid" << std::endl
+			<< "  --scene name|file        built-in scene, uniform:n or clustered:n, or scene description file" << std::endl
+			<< "  --trace file             write a Chrome trace of the render" << std::endl
+			<< "  --passes n               accumulate n passes with different seeds (1)" << std::endl
+			<< "  --exposure f, --gamma f  tonemap parameters (" << EXPOSURE << ", " << GAMMA << ")" << std::endl
+			<< "  --hdr file               also write the float image as PFM" << std::endl
+			<< "  --tonemap file           re-tonemap a PFM file instead of rendering" << std::endl
+			<< "  --accel-cache dir        map built quadtree/bvh from dir, writing it on a miss" << std::endl
+			<< "  --light-paths n          light paths per pixel with --light-trace (" << LIGHT_PATHS << ")" << std::endl
+			<< "  --progressive            write coarse previews to preview.png before the full render" << std::endl
+			<< "  --denoise                edge-aware denoise guided by entity id, emissive and hit distance" << std::endl
+			<< "  --threads n              worker threads (0 = one per core)" << std::endl
+			<< "  --workers n              render tiles in n local worker processes (" << DIST_WORKERS << ")" << std::endl
+			<< "  --listen port            accept workers on port (a free one with --workers)" << std::endl
+			<< "  --worker host:port       render tiles for the coordinator at host:port" << std::endl
+			<< "  --bind address           address for --listen and --serve, 0.0.0.0 for all interfaces (" << LISTEN_ADDRESS << ")" << std::endl
+			<< "  --serve                  answer render requests on stdin, or on the --listen port" << std::endl
+			<< "  --serve-dir dir          directory for the scene files and images of --serve requests" << std::endl
+			<< "  --scaling                render with 1, 2, 4... threads and print the speedup" << std::endl
+			<< "  --simd-bench             compare packet intersection speed per instruction set on the built-in scenes" << std::endl
+			<< "  --debug, --no-packet, --hero, --path-tracer, --adaptive, --light-trace, --sweep" << std::endl;
+	}
+	//解析命令行参数，出错时打印用法并返回false
+	bool Parse(int argc, char** argv)
+	{
+		for (int i = 1; i < argc; i++)
+		{
+			const char* arg = argv[i];
+			const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+			bool ok = true;
+			if (!strcmp(arg, "--debug")) debug = true;
+			else if (!strcmp(arg, "--no-packet")) packet = false;
+			else if (!strcmp(arg, "--hero")) hero = true;
+			else if (!strcmp(arg, "--path-tracer")) path_tracer = true;
+			else if (!strcmp(arg, "--adaptive")) adaptive = true;
+			else if (!strcmp(arg, "--light-trace")) light_trace = true;
+			else if (!strcmp(arg, "--progressive")) progressive = true;
+			else if (!strcmp(arg, "--denoise")) denoise = true;
+			else if (!strcmp(arg, "--serve")) serve = true;
+			else if (!strcmp(arg, "--sweep")) sweep = true;
+			else if (!strcmp(arg, "--scaling")) scaling = true;
+			else if (!strcmp(arg, "--simd-bench")) simd_bench = true;
+			else if (!value) ok = false;
+			else
+			{
+				i++;
+				if (!strcmp(arg, "--width")) width = atoi(value);
+				else if (!strcmp(arg, "--height")) height = atoi(value);
+				else if (!strcmp(arg, "--samples")) samples = atoi(value);
+				else if (!strcmp(arg, "--light-samples")) light_samples = atoi(value);
+				else if (!strcmp(arg, "--light-paths")) light_paths = atoi(value);
+				else if (!strcmp(arg, "--threads")) threads = atoi(value);
+				else if (!strcmp(arg, "--workers")) workers = atoi(value);
+				else if (!strcmp(arg, "--listen")) port = atoi(value);
+				else if (!strcmp(arg, "--worker")) worker = value;
+				else if (!strcmp(arg, "--bind")) listen_address = value;
+				else if (!strcmp(arg, "--bins")) bins = atoi(value);
+				else if (!strcmp(arg, "--depth")) max_depth = atoi(value);
+				else if (!strcmp(arg, "--tree-depth")) tree_depth = atoi(value);
+				else if (!strcmp(arg, "--seed")) seed = (unsigned int)strtoul(value, NULL, 10);
+				else if (!strcmp(arg, "--scene")) scene = value;
+				else if (!strcmp(arg, "--trace")) trace = value;
+				else if (!strcmp(arg, "--passes")) passes = atoi(value);
+				else if (!strcmp(arg, "--exposure")) exposure = (float)atof(value);
+				else if (!strcmp(arg, "--gamma")) gamma = (float)atof(value);
+				else if (!strcmp(arg, "--hdr")) hdr = value;
+				else if (!strcmp(arg, "--tonemap")) tonemap = value;
+				else if (!strcmp(arg, "--accel-cache")) accel_cache = value;
+				else if (!strcmp(arg, "--serve-dir")) serve_dir = value;
+				else if (!strcmp(arg, "--accel"))
+				{
+					ok = false;
+					for (int k = 0; k < ACCEL_NUM; k++)
+						if (!strcmp(value, GetAccelName((AccelType)k)))
+						{
+							accel = (AccelType)k;
+							ok = true;
+						}
+				}
+				else ok = false;
+			}
+			if (!ok)
+			{
+				std::cerr << "invalid argument: " << arg << std::endl;
+				PrintUsage(std::cerr, argv[0]);
+				return false;
+			}
+		}
+		if (width <= 0 || height <= 0 || samples <= 0 || samples > MAX_SAMPLES || light_samples < 0 || samples + light_samples > MAX_SAMPLES || bins < 2 || bins > MAX_SPECTRUM_BINS || max_depth < 0 || tree_depth < 0
+			|| passes <= 0 || light_paths <= 0 || threads < 0 || workers < 0 || port < 0 || port > 65535 || exposure <= 0.f || gamma <= 0.f)
+		{
+			std::cerr << "invalid settings" << std::endl;
+			PrintUsage(std::cerr, argv[0]);
+			return false;
+		}
+		return true;
+	}
+	//影响每个像素结果的参数的指纹，分布式渲染时用来检查worker与协调进程的参数一致
+	uint32_t Fingerprint()
+	{
+		std::ostringstream text;
+		Print(text);
+		text << scene;
+		uint32_t hash = 2166136261u;
+		for (char c : text.str())
+			hash = (hash ^ (unsigned char)c) * 16777619u;
+		return hash;
+	}
+	void Print(std::ostream& out)
+	{
+		if (light_trace)
+		{
+			out << width << "x" << height << ", light trace, " << light_paths << " light paths per pixel, " << bins << " bins, " << GetAccelName(accel) << std::endl;
+			return;
+		}
+		out << width << "x" << height << ", " << samples << " samples, " << (light_samples ? std::to_string(light_samples) + " light samples, " : "") << bins << " bins, depth " << max_depth
+			<< ", " << GetAccelName(accel) << (packet ? ", packet" : "") << (hero ? ", hero" : "")
+			<< (path_tracer ? ", path tracer" : "") << (adaptive ? ", adaptive" : "") << (progressive ? ", progressive" : "") << (denoise ? ", denoise" : "") << std::endl;
+	}
+};
@@ -1,6 +1,9 @@
 #pragma once
 
 #include "basic.h"
+#include "Simd.h"
+#include "Stats.h"
+#include <vector>
 
 #define EPSILON 1e-5f
 
@@ -8,7 +11,7 @@ class Shape
 {
 public:
 	Shape() {}
-	~Shape() {}
+	virtual ~Shape() {}
 	//判断是否相交
 	virtual bool Intersect(Point p, Vector d)
 	{
@@ -19,6 +22,14 @@ public:
 	{
 		return false;
 	}
+	//判断是否相交并求交点和交点处的法向，能在求交时顺便得到法向的shape可以重载
+	virtual bool Intersect(Point p, Vector d, Point& inter, Vector& normal)
+	{
+		if (!Intersect(p, d, inter))
+			return false;
+		normal = GetNormal(inter);
+		return true;
+	}
 	//判断是否在shape内部
 	virtual bool IsInside(Point p)
 	{
@@ -39,6 +50,20 @@ public:
 	{
 		return false;
 	}
+	//获取包围盒，无界的shape返回false
+	virtual bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		return false;
+	}
+	//射线包求交：从p出发的n条射线(dx[i], dy[i])，交点距离写入dist[i]，不相交为PACKET_MISS
+	virtual void IntersectPacket(Point p, const float* dx, const float* dy, int n, float* dist)
+	{
+		for (int i = 0; i < n; i++)
+		{
+			Point inter;
+			dist[i] = Intersect(p, { dx[i], dy[i] }, inter) ? (inter - p).len() : PACKET_MISS;
+		}
+	}
 };
 
 class Line :public Shape
@@ -103,6 +128,7 @@ public:
 
 	bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_SHAPE(STAT_SHAPE_LINE, 1);
 		if (IsInside(p))
 		{
 			//inter = p;
@@ -119,6 +145,12 @@ public:
 		}
 		return false;
 	}
+	void IntersectPacket(Point p, const float* dx, const float* dy, int n, float* dist)
+	{
+		STAT_SHAPE(STAT_SHAPE_LINE, n);
+		Point behind = { -1.f, -1.f };		//与Intersect一致，p在内部且交点在背后时交点记为(-1, -1)
+		LinePacket(m_a, m_b, p.x * m_a + p.y * m_b + m_c, (behind - p).len(), dx, dy, n, dist);
+	}
 };
 
 class Circle :public Shape
@@ -153,6 +185,7 @@ public:
 	}
 	bool Intersect(Point p, Vector d, Point& inter)
 	{
+		STAT_SHAPE(STAT_SHAPE_CIRCLE, 1);
 		if (IsInside(p))
 		{
 			float proj = (m_o - p)*d;
@@ -177,6 +210,182 @@ public:
 		return (m_o.x - m_r > left) && (m_o.x + m_r < right) 
 				&& (m_o.y - m_r > up) && (m_o.y + m_r < down);
 	}
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		left = m_o.x - m_r, right = m_o.x + m_r;
+		up = m_o.y - m_r, down = m_o.y + m_r;
+		return true;
+	}
+	void IntersectPacket(Point p, const float* dx, const float* dy, int n, float* dist)
+	{
+		STAT_SHAPE(STAT_SHAPE_CIRCLE, n);
+		Vector l = m_o - p;
+		CirclePacket(l.x, l.y, l * l, m_r * m_r, dx, dy, n, dist);
+	}
+};
+
+//凸多边形：所有边的半平面连续存放，一次遍历求出入射点、出射点和对应的边
+class ConvexPolygon :public Shape
+{
+protected:
+	//第i条边的半平面为m_a[i]*x + m_b[i]*y + m_c[i] >= 0，(m_a[i], m_b[i])为单位向量
+	std::vector<float> m_a;
+	std::vector<float> m_b;
+	std::vector<float> m_c;
+	float m_left, m_right, m_up, m_down;	//包围盒
+	//返回离p最近的边
+	int NearestEdge(Point p)
+	{
+		int edge = 0;
+		float min_dist = fabsf(m_a[0] * p.x + m_b[0] * p.y + m_c[0]);
+		for (int i = 1; i < (int)m_a.size(); i++)
+		{
+			float dist = fabsf(m_a[i] * p.x + m_b[i] * p.y + m_c[i]);
+			if (dist < min_dist)
+			{
+				min_dist = dist;
+				edge = i;
+			}
+		}
+		return edge;
+	}
+public:
+	//顶点按顺序给出，顺时针或逆时针均可
+	ConvexPolygon(const std::vector<Point>& points)
+	{
+		Point center = { 0.f, 0.f };
+		for (auto p : points)
+			center.x += p.x, center.y += p.y;
+		center = { center.x / points.size(), center.y / points.size() };
+		m_left = m_up = 1e10f;
+		m_right = m_down = -1e10f;
+		for (size_t i = 0; i < points.size(); i++)
+		{
+			Point p1 = points[i];
+			Point p2 = points[(i + 1) % points.size()];
+			float a = p2.y - p1.y;
+			float b = p1.x - p2.x;
+			float c = p2.x*p1.y - p1.x*p2.y;
+			if (a * center.x + b * center.y + c < 0.f)
+				a = -a, b = -b, c = -c;
+			float len = sqrtf(a*a + b*b);
+			if (len <= 0.f) continue;		//忽略重合的顶点
+			m_a.push_back(a / len);
+			m_b.push_back(b / len);
+			m_c.push_back(c / len);
+			m_left = fminf(m_left, p1.x);
+			m_right = fmaxf(m_right, p1.x);
+			m_up = fminf(m_up, p1.y);
+			m_down = fmaxf(m_down, p1.y);
+		}
+		//顶点重合得不到3条边时，用一个处处不满足的半平面表示空的多边形，保证至少有一条边
+		if (m_a.size() < 3)
+		{
+			m_a.assign(1, 0.f);
+			m_b.assign(1, 0.f);
+			m_c.assign(1, -1.f);
+		}
+	}
+	//长度不为0的边数，与构造函数保留的边一致，少于3条时不构成多边形
+	static int CountEdges(const Point* points, int n)
+	{
+		int count = 0;
+		for (int i = 0; i < n; i++)
+		{
+			Point p1 = points[i];
+			Point p2 = points[(i + 1) % n];
+			float a = p2.y - p1.y;
+			float b = p1.x - p2.x;
+			if (sqrtf(a*a + b*b) > 0.f)
+				count++;
+		}
+		return count;
+	}
+	int GetEdgeCount() { return (int)m_a.size(); }
+	bool IsInside(Point p)
+	{
+		for (size_t i = 0; i < m_a.size(); i++)
+			if (m_a[i] * p.x + m_b[i] * p.y + m_c[i] < 0.f)
+				return false;
+		return true;
+	}
+	bool IsOnBoundary(Point p)
+	{
+		int edge = NearestEdge(p);
+		return fabsf(m_a[edge] * p.x + m_b[edge] * p.y + m_c[edge]) <= EPSILON;
+	}
+	Vector GetNormal(Point p)
+	{
+		int edge = NearestEdge(p);
+		return{ -m_a[edge], -m_b[edge] };
+	}
+	//Cyrus-Beck裁剪：p在外部时返回入射点，在内部时返回出射点，t为沿d的距离，edge为交点所在的边
+	bool IntersectEdge(Point p, Vector d, float& t, int& edge)
+	{
+		float t_enter = 0.f, t_exit = 1e10f;
+		int edge_enter = -1, edge_exit = -1;
+		for (size_t i = 0; i < m_a.size(); i++)
+		{
+			float f = m_a[i] * p.x + m_b[i] * p.y + m_c[i];	//p到边的有向距离，内部为正
+			float g = m_a[i] * d.x + m_b[i] * d.y;			//沿d前进时f的变化率
+			if (g == 0.f)
+			{
+				if (f < 0.f) return false;		//与边平行且在外部
+				continue;
+			}
+			float tmp_t = -f / g;
+			if (g > 0.f)
+			{
+				if (tmp_t > t_enter)
+					t_enter = tmp_t, edge_enter = (int)i;
+			}
+			else if (tmp_t < t_exit)
+				t_exit = tmp_t, edge_exit = (int)i;
+			if (t_enter > t_exit) return false;
+		}
+		if (edge_enter >= 0)
+			t = t_enter, edge = edge_enter;
+		else if (edge_exit >= 0)
+			t = t_exit, edge = edge_exit;
+		else
+			return false;
+		return true;
+	}
+	bool Intersect(Point p, Vector d)
+	{
+		float t;
+		int edge;
+		return IntersectEdge(p, d, t, edge);
+	}
+	bool Intersect(Point p, Vector d, Point& inter)
+	{
+		STAT_SHAPE(STAT_SHAPE_POLYGON, 1);
+		float t;
+		int edge;
+		if (!IntersectEdge(p, d, t, edge)) return false;
+		inter = p + d * t;
+		return true;
+	}
+	//交点所在的边由IntersectEdge直接给出，不用再找离交点最近的边
+	bool Intersect(Point p, Vector d, Point& inter, Vector& normal)
+	{
+		STAT_SHAPE(STAT_SHAPE_POLYGON, 1);
+		float t;
+		int edge;
+		if (!IntersectEdge(p, d, t, edge)) return false;
+		inter = p + d * t;
+		normal = { -m_a[edge], -m_b[edge] };
+		return true;
+	}
+	bool Contained(float left, float right, float up, float down)
+	{
+		return (m_left > left) && (m_right < right) && (m_up > up) && (m_down < down);
+	}
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		left = m_left, right = m_right, up = m_up, down = m_down;
+		return true;
+	}
 };
 
 class ShapeUnion :public Shape
@@ -202,6 +411,15 @@ public:
 	{
 		return m_shape1->IsOnBoundary(p) || m_shape2->IsOnBoundary(p);
 	}
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		float l1, r1, u1, d1, l2, r2, u2, d2;
+		if (!m_shape1->GetBound(l1, r1, u1, d1) || !m_shape2->GetBound(l2, r2, u2, d2))
+			return false;
+		left = fminf(l1, l2), right = fmaxf(r1, r2);
+		up = fminf(u1, u2), down = fmaxf(d1, d2);
+		return true;
+	}
 	Vector GetNormal(Point p)
 	{
 		if (m_shape1->IsOnBoundary(p) && m_shape2->IsOnBoundary(p))
@@ -222,6 +440,7 @@ public:
 
 	bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_SHAPE(STAT_SHAPE_UNION, 1);
 		Point inter1, inter2;
 		bool res1 = m_shape1->Intersect(p, d, inter1);
 		bool res2 = m_shape2->Intersect(p, d, inter2);
@@ -261,6 +480,22 @@ public:
 	{
 		return m_shape1->IsOnBoundary(p) || m_shape2->IsOnBoundary(p);
 	}
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		float l1, r1, u1, d1, l2, r2, u2, d2;
+		bool bound1 = m_shape1->GetBound(l1, r1, u1, d1);
+		bool bound2 = m_shape2->GetBound(l2, r2, u2, d2);
+		if (bound1 && bound2)
+		{
+			left = fmaxf(l1, l2), right = fminf(r1, r2);
+			up = fmaxf(u1, u2), down = fminf(d1, d2);
+		}
+		else if (bound1)
+			left = l1, right = r1, up = u1, down = d1;
+		else if (bound2)
+			left = l2, right = r2, up = u2, down = d2;
+		return bound1 || bound2;
+	}
 	Vector GetNormal(Point p)
 	{
 		if (m_shape1->IsOnBoundary(p) && m_shape2->IsOnBoundary(p))
@@ -282,6 +517,7 @@ public:
 
 	bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_SHAPE(STAT_SHAPE_INTERSECT, 1);
 		Point inter1, inter2;
 		if (!(m_shape1->Intersect(p, d, inter1) && m_shape2->Intersect(p, d, inter2)))
 			return false;
@@ -319,6 +555,10 @@ public:
 	{
 		return m_shape1->IsOnBoundary(p) || m_shape2->IsOnBoundary(p);
 	}
+	bool GetBound(float& left, float& right, float& up, float& down)
+	{
+		return m_shape1->GetBound(left, right, up, down);
+	}
 	Vector GetNormal(Point p)
 	{
 		if (m_shape1->IsOnBoundary(p) && m_shape2->IsOnBoundary(p))
@@ -340,6 +580,7 @@ public:
 
 	bool Intersect(Point p, Vector d, Point &inter)
 	{
+		STAT_SHAPE(STAT_SHAPE_SUBSTRACT, 1);
 		Point inter1, inter2;
 		if (!(m_shape1->Intersect(p, d, inter1) && m_shape2->Intersect(p, d, inter2)))
 			return false;
@@ -0,0 +1,339 @@
+#pragma once
+#include <math.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define SIMD_X86 1
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#else
+#define SIMD_X86 0
+#endif
+
+//GCC/Clang需要为单个函数打开指令集，MSVC可直接使用intrinsic
+#if SIMD_X86 && (defined(__GNUC__) || defined(__clang__))
+#define SIMD_TARGET(t) __attribute__((target(t)))
+#else
+#define SIMD_TARGET(t)
+#endif
+
+#define PACKET_SIZE 16		//一个射线包最多包含的射线数
+#define PACKET_MISS 1e30f	//未相交时的距离
+
+enum SimdLevel
+{
+	SIMD_SCALAR,
+	SIMD_SSE,		//4路
+	SIMD_AVX2,		//8路
+	SIMD_AVX512,	//16路
+};
+
+inline const char* GetSimdName(SimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_SSE: return "sse";
+	case SIMD_AVX2: return "avx2";
+	case SIMD_AVX512: return "avx512";
+	default: return "scalar";
+	}
+}
+
+//通过CPUID检测当前CPU和操作系统支持的最高指令集
+inline SimdLevel DetectSimdLevel()
+{
+#if SIMD_X86
+#ifdef _MSC_VER
+	int info[4];
+	__cpuid(info, 0);
+	int max_leaf = info[0];
+	__cpuid(info, 1);
+	bool sse2 = (info[3] & (1 << 26)) != 0;
+	bool osxsave = (info[2] & (1 << 27)) != 0;
+	bool avx = (info[2] & (1 << 28)) != 0;
+	unsigned long long xcr0 = osxsave ? _xgetbv(0) : 0;
+	bool avx2 = false, avx512 = false;
+	if (max_leaf >= 7)
+	{
+		__cpuidex(info, 7, 0);
+		avx2 = (info[1] & (1 << 5)) != 0;
+		avx512 = (info[1] & (1 << 16)) != 0;
+	}
+	if (avx512 && (xcr0 & 0xE6) == 0xE6) return SIMD_AVX512;
+	if (avx && avx2 && (xcr0 & 0x6) == 0x6) return SIMD_AVX2;
+	if (sse2) return SIMD_SSE;
+#else
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f")) return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2")) return SIMD_AVX2;
+	if (__builtin_cpu_supports("sse2")) return SIMD_SSE;
+#endif
+#endif
+	return SIMD_SCALAR;
+}
+
+//当前使用的指令集，默认为检测到的最高指令集，测试时可以改小
+inline SimdLevel& ActiveSimdLevel()
+{
+	static SimdLevel level = DetectSimdLevel();
+	return level;
+}
+
+//以下为射线包求交的内核，所有射线起点相同，方向为(dx[i], dy[i])，结果写入dist[i]
+//SIMD内核从begin开始按组处理，返回处理到的位置，剩余不足一组的射线依次交给更窄的内核，最后由标量内核处理
+
+//直线(半平面)：f为起点处a*x + b*y + c的值，behind为起点在内部且交点在背后时的距离
+inline void LinePacketScalar(float a, float b, float f, float behind, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	for (int i = begin; i < n; i++)
+	{
+		float g = a * dx[i] + b * dy[i];
+		float t = -f / g;
+		if (f >= 0.f)
+			dist[i] = t >= 0.f ? t : behind;
+		else
+			dist[i] = g > 0.f ? t : PACKET_MISS;
+	}
+}
+
+//圆：(lx, ly)为起点指向圆心的向量，l2为其长度平方
+inline void CirclePacketScalar(float lx, float ly, float l2, float r2, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	for (int i = begin; i < n; i++)
+	{
+		float proj = lx * dx[i] + ly * dy[i];
+		float h2 = r2 - l2 + proj * proj;
+		if (l2 <= r2)
+			dist[i] = proj + sqrtf(h2 > 0.f ? h2 : 0.f);
+		else
+			dist[i] = (proj > 0.f && h2 >= 0.f) ? proj - sqrtf(h2) : PACKET_MISS;
+	}
+}
+
+//用tmp中更近的交点更新dist和对应的entity编号
+inline void NearestPacketScalar(const float* tmp, int index, int begin, int n, float* dist, int* nearest)
+{
+	for (int i = begin; i < n; i++)
+		if (tmp[i] < dist[i])
+		{
+			dist[i] = tmp[i];
+			nearest[i] = index;
+		}
+}
+
+#if SIMD_X86
+SIMD_TARGET("sse2")
+inline int LinePacketSSE(float a, float b, float f, float behind, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m128 va = _mm_set1_ps(a), vb = _mm_set1_ps(b), vnf = _mm_set1_ps(-f);
+	__m128 other = _mm_set1_ps(f >= 0.f ? behind : PACKET_MISS), zero = _mm_setzero_ps();
+	int i = begin;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 g = _mm_add_ps(_mm_mul_ps(va, _mm_loadu_ps(dx + i)), _mm_mul_ps(vb, _mm_loadu_ps(dy + i)));
+		__m128 t = _mm_div_ps(vnf, g);
+		__m128 mask = f >= 0.f ? _mm_cmpge_ps(t, zero) : _mm_cmpgt_ps(g, zero);
+		_mm_storeu_ps(dist + i, _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, other)));
+	}
+	return i;
+}
+
+SIMD_TARGET("sse2")
+inline int CirclePacketSSE(float lx, float ly, float l2, float r2, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m128 vlx = _mm_set1_ps(lx), vly = _mm_set1_ps(ly), vc = _mm_set1_ps(r2 - l2);
+	__m128 vmiss = _mm_set1_ps(PACKET_MISS), zero = _mm_setzero_ps();
+	int i = begin;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 proj = _mm_add_ps(_mm_mul_ps(vlx, _mm_loadu_ps(dx + i)), _mm_mul_ps(vly, _mm_loadu_ps(dy + i)));
+		__m128 h2 = _mm_add_ps(vc, _mm_mul_ps(proj, proj));
+		__m128 h = _mm_sqrt_ps(_mm_max_ps(h2, zero));
+		__m128 t;
+		if (l2 <= r2)
+			t = _mm_add_ps(proj, h);
+		else
+		{
+			__m128 mask = _mm_and_ps(_mm_cmpgt_ps(proj, zero), _mm_cmpge_ps(h2, zero));
+			t = _mm_or_ps(_mm_and_ps(mask, _mm_sub_ps(proj, h)), _mm_andnot_ps(mask, vmiss));
+		}
+		_mm_storeu_ps(dist + i, t);
+	}
+	return i;
+}
+
+SIMD_TARGET("sse2")
+inline int NearestPacketSSE(const float* tmp, int index, int begin, int n, float* dist, int* nearest)
+{
+	__m128i vindex = _mm_set1_epi32(index);
+	int i = begin;
+	for (; i + 4 <= n; i += 4)
+	{
+		__m128 t = _mm_loadu_ps(tmp + i), d = _mm_loadu_ps(dist + i);
+		__m128 mask = _mm_cmplt_ps(t, d);
+		__m128i imask = _mm_castps_si128(mask);
+		__m128i old = _mm_loadu_si128((__m128i*)(nearest + i));
+		_mm_storeu_ps(dist + i, _mm_or_ps(_mm_and_ps(mask, t), _mm_andnot_ps(mask, d)));
+		_mm_storeu_si128((__m128i*)(nearest + i), _mm_or_si128(_mm_and_si128(imask, vindex), _mm_andnot_si128(imask, old)));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx2")
+inline int LinePacketAVX2(float a, float b, float f, float behind, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m256 va = _mm256_set1_ps(a), vb = _mm256_set1_ps(b), vnf = _mm256_set1_ps(-f);
+	__m256 other = _mm256_set1_ps(f >= 0.f ? behind : PACKET_MISS), zero = _mm256_setzero_ps();
+	int i = begin;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 g = _mm256_add_ps(_mm256_mul_ps(va, _mm256_loadu_ps(dx + i)), _mm256_mul_ps(vb, _mm256_loadu_ps(dy + i)));
+		__m256 t = _mm256_div_ps(vnf, g);
+		__m256 mask = f >= 0.f ? _mm256_cmp_ps(t, zero, _CMP_GE_OQ) : _mm256_cmp_ps(g, zero, _CMP_GT_OQ);
+		_mm256_storeu_ps(dist + i, _mm256_blendv_ps(other, t, mask));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx2")
+inline int CirclePacketAVX2(float lx, float ly, float l2, float r2, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m256 vlx = _mm256_set1_ps(lx), vly = _mm256_set1_ps(ly), vc = _mm256_set1_ps(r2 - l2);
+	__m256 vmiss = _mm256_set1_ps(PACKET_MISS), zero = _mm256_setzero_ps();
+	int i = begin;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 proj = _mm256_add_ps(_mm256_mul_ps(vlx, _mm256_loadu_ps(dx + i)), _mm256_mul_ps(vly, _mm256_loadu_ps(dy + i)));
+		__m256 h2 = _mm256_add_ps(vc, _mm256_mul_ps(proj, proj));
+		__m256 h = _mm256_sqrt_ps(_mm256_max_ps(h2, zero));
+		__m256 t;
+		if (l2 <= r2)
+			t = _mm256_add_ps(proj, h);
+		else
+		{
+			__m256 mask = _mm256_and_ps(_mm256_cmp_ps(proj, zero, _CMP_GT_OQ), _mm256_cmp_ps(h2, zero, _CMP_GE_OQ));
+			t = _mm256_blendv_ps(vmiss, _mm256_sub_ps(proj, h), mask);
+		}
+		_mm256_storeu_ps(dist + i, t);
+	}
+	return i;
+}
+
+SIMD_TARGET("avx2")
+inline int NearestPacketAVX2(const float* tmp, int index, int begin, int n, float* dist, int* nearest)
+{
+	__m256 vindex = _mm256_castsi256_ps(_mm256_set1_epi32(index));
+	int i = begin;
+	for (; i + 8 <= n; i += 8)
+	{
+		__m256 t = _mm256_loadu_ps(tmp + i), d = _mm256_loadu_ps(dist + i);
+		__m256 mask = _mm256_cmp_ps(t, d, _CMP_LT_OQ);
+		__m256 old = _mm256_loadu_ps((float*)(nearest + i));
+		_mm256_storeu_ps(dist + i, _mm256_blendv_ps(d, t, mask));
+		_mm256_storeu_ps((float*)(nearest + i), _mm256_blendv_ps(old, vindex, mask));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx512f")
+inline int LinePacketAVX512(float a, float b, float f, float behind, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m512 va = _mm512_set1_ps(a), vb = _mm512_set1_ps(b), vnf = _mm512_set1_ps(-f);
+	__m512 other = _mm512_set1_ps(f >= 0.f ? behind : PACKET_MISS), zero = _mm512_setzero_ps();
+	int i = begin;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512 g = _mm512_add_ps(_mm512_mul_ps(va, _mm512_loadu_ps(dx + i)), _mm512_mul_ps(vb, _mm512_loadu_ps(dy + i)));
+		__m512 t = _mm512_div_ps(vnf, g);
+		__mmask16 mask = f >= 0.f ? _mm512_cmp_ps_mask(t, zero, _CMP_GE_OQ) : _mm512_cmp_ps_mask(g, zero, _CMP_GT_OQ);
+		_mm512_storeu_ps(dist + i, _mm512_mask_blend_ps(mask, other, t));
+	}
+	return i;
+}
+
+SIMD_TARGET("avx512f")
+inline int CirclePacketAVX512(float lx, float ly, float l2, float r2, const float* dx, const float* dy, int begin, int n, float* dist)
+{
+	__m512 vlx = _mm512_set1_ps(lx), vly = _mm512_set1_ps(ly), vc = _mm512_set1_ps(r2 - l2);
+	__m512 vmiss = _mm512_set1_ps(PACKET_MISS), zero = _mm512_setzero_ps();
+	int i = begin;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512 proj = _mm512_add_ps(_mm512_mul_ps(vlx, _mm512_loadu_ps(dx + i)), _mm512_mul_ps(vly, _mm512_loadu_ps(dy + i)));
+		__m512 h2 = _mm512_add_ps(vc, _mm512_mul_ps(proj, proj));
+		__m512 h = _mm512_sqrt_ps(_mm512_max_ps(h2, zero));
+		__m512 t;
+		if (l2 <= r2)
+			t = _mm512_add_ps(proj, h);
+		else
+		{
+			__mmask16 mask = _mm512_cmp_ps_mask(proj, zero, _CMP_GT_OQ) & _mm512_cmp_ps_mask(h2, zero, _CMP_GE_OQ);
+			t = _mm512_mask_blend_ps(mask, vmiss, _mm512_sub_ps(proj, h));
+		}
+		_mm512_storeu_ps(dist + i, t);
+	}
+	return i;
+}
+
+SIMD_TARGET("avx512f")
+inline int NearestPacketAVX512(const float* tmp, int index, int begin, int n, float* dist, int* nearest)
+{
+	__m512i vindex = _mm512_set1_epi32(index);
+	int i = begin;
+	for (; i + 16 <= n; i += 16)
+	{
+		__m512 t = _mm512_loadu_ps(tmp + i), d = _mm512_loadu_ps(dist + i);
+		__mmask16 mask = _mm512_cmp_ps_mask(t, d, _CMP_LT_OQ);
+		_mm512_storeu_ps(dist + i, _mm512_mask_blend_ps(mask, d, t));
+		_mm512_mask_storeu_epi32(nearest + i, mask, vindex);
+	}
+	return i;
+}
+#endif // SIMD_X86
+
+//根据ActiveSimdLevel()选择内核，较宽内核剩下的射线由较窄的内核接着处理
+inline void LinePacket(float a, float b, float f, float behind, const float* dx, const float* dy, int n, float* dist)
+{
+	int done = 0;
+#if SIMD_X86
+	switch (ActiveSimdLevel())
+	{
+	case SIMD_AVX512: done = LinePacketAVX512(a, b, f, behind, dx, dy, done, n, dist);	// fall through
+	case SIMD_AVX2: done = LinePacketAVX2(a, b, f, behind, dx, dy, done, n, dist);	// fall through
+	case SIMD_SSE: done = LinePacketSSE(a, b, f, behind, dx, dy, done, n, dist); break;
+	default: break;
+	}
+#endif
+	LinePacketScalar(a, b, f, behind, dx, dy, done, n, dist);
+}
+
+inline void CirclePacket(float lx, float ly, float l2, float r2, const float* dx, const float* dy, int n, float* dist)
+{
+	int done = 0;
+#if SIMD_X86
+	switch (ActiveSimdLevel())
+	{
+	case SIMD_AVX512: done = CirclePacketAVX512(lx, ly, l2, r2, dx, dy, done, n, dist);	// fall through
+	case SIMD_AVX2: done = CirclePacketAVX2(lx, ly, l2, r2, dx, dy, done, n, dist);	// fall through
+	case SIMD_SSE: done = CirclePacketSSE(lx, ly, l2, r2, dx, dy, done, n, dist); break;
+	default: break;
+	}
+#endif
+	CirclePacketScalar(lx, ly, l2, r2, dx, dy, done, n, dist);
+}
+
+inline void NearestPacket(const float* tmp, int index, int n, float* dist, int* nearest)
+{
+	int done = 0;
+#if SIMD_X86
+	switch (ActiveSimdLevel())
+	{
+	case SIMD_AVX512: done = NearestPacketAVX512(tmp, index, done, n, dist, nearest);	// fall through
+	case SIMD_AVX2: done = NearestPacketAVX2(tmp, index, done, n, dist, nearest);	// fall through
+	case SIMD_SSE: done = NearestPacketSSE(tmp, index, done, n, dist, nearest); break;
+	default: break;
+	}
+#endif
+	NearestPacketScalar(tmp, index, done, n, dist, nearest);
+}
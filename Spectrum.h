@@ -0,0 +1,82 @@
+#pragma once
+#include <stdio.h>
+#include <vector>
+#include <fstream>
+#include "basic.h"
+
+#define SPECTRUM_MIN 380.f	//参与计算的波长范围(nm)
+#define SPECTRUM_MAX 780.f
+
+//把可见光谱等分为若干段，由CIE 1931颜色匹配函数计算每段对应的RGB权重
+//第0段为红色一端，与Entity中折射率从小到大的顺序一致
+class Spectrum
+{
+protected:
+	std::vector<float> m_lambda;	//表中的波长
+	std::vector<Color> m_xyz;		//对应的XYZ
+	std::vector<Color> m_weight;	//每段的RGB权重，各段平均为1，白光经过色散后仍为白色
+
+	Color GetXYZ(float lambda)
+	{
+		if (lambda <= m_lambda.front()) return m_xyz.front();
+		if (lambda >= m_lambda.back()) return m_xyz.back();
+		size_t i = 1;
+		while (m_lambda[i] < lambda) i++;
+		float t = (lambda - m_lambda[i - 1]) / (m_lambda[i] - m_lambda[i - 1]);
+		return m_xyz[i - 1] * (1.f - t) + m_xyz[i] * t;
+	}
+public:
+	//读取ciexyz31.csv，bins为分段数，失败时返回false
+	bool Load(const char* filename, int bins)
+	{
+		std::ifstream file(filename);
+		if (!file) return false;
+		//Configure每次都会重新读取，先清掉上次的表
+		m_lambda.clear();
+		m_xyz.clear();
+		char str[300];
+		file >> str;	//表头
+		while (file >> str)
+		{
+			float lambda;
+			Color xyz;
+			if (sscanf(str, "%f,%f,%f,%f", &lambda, &xyz.r, &xyz.g, &xyz.b) == 4)
+			{
+				m_lambda.push_back(lambda);
+				m_xyz.push_back(xyz);
+			}
+		}
+		if (m_lambda.size() < 2) return false;
+		m_weight.assign(bins, { 0.f, 0.f, 0.f });
+		Color sum = { 0.f, 0.f, 0.f };
+		float step = (SPECTRUM_MAX - SPECTRUM_MIN) / bins;
+		for (int i = 0; i < bins; i++)
+		{
+			//每段内按1nm积分
+			Color xyz = { 0.f, 0.f, 0.f };
+			float hi = SPECTRUM_MAX - step * i;
+			for (float lambda = hi - step + 0.5f; lambda < hi; lambda += 1.f)
+				xyz = xyz + GetXYZ(lambda);
+			//XYZ转线性sRGB，光谱色超出sRGB色域的部分截断
+			Color rgb = { 3.2406f * xyz.r - 1.5372f * xyz.g - 0.4986f * xyz.b,
+						-0.9689f * xyz.r + 1.8758f * xyz.g + 0.0415f * xyz.b,
+						0.0557f * xyz.r - 0.2040f * xyz.g + 1.0570f * xyz.b };
+			rgb.r = fmaxf(rgb.r, 0.f);
+			rgb.g = fmaxf(rgb.g, 0.f);
+			rgb.b = fmaxf(rgb.b, 0.f);
+			m_weight[i] = rgb;
+			sum = sum + rgb;
+		}
+		for (int i = 0; i < bins; i++)
+			m_weight[i] = { m_weight[i].r * bins / sum.r, m_weight[i].g * bins / sum.g, m_weight[i].b * bins / sum.b };
+		return true;
+	}
+	bool IsLoaded() { return !m_weight.empty(); }
+	void SetWeight(int index, Color weight)
+	{
+		if (index >= (int)m_weight.size())
+			m_weight.resize(index + 1);
+		m_weight[index] = weight;
+	}
+	Color GetWeight(int index) { return m_weight[index]; }
+};
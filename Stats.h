@@ -0,0 +1,134 @@
+#pragma once
+#include <mutex>
+#include <vector>
+#include <iostream>
+
+#ifndef ENABLE_STATS
+#define ENABLE_STATS false		//统计射线数和求交次数，关闭时计数代码不参与编译
+#endif
+
+#define STAT_DEPTH_NUM 16		//按深度统计射线数，更深的计入最后一项
+
+//按shape类型统计求交次数，组合shape的子shape也各自计数
+enum StatShape
+{
+	STAT_SHAPE_LINE,
+	STAT_SHAPE_CIRCLE,
+	STAT_SHAPE_POLYGON,
+	STAT_SHAPE_UNION,
+	STAT_SHAPE_INTERSECT,
+	STAT_SHAPE_SUBSTRACT,
+	STAT_SHAPE_NUM
+};
+
+inline const char* GetStatShapeName(int type)
+{
+	static const char* names[STAT_SHAPE_NUM] = { "line", "circle", "polygon", "union", "intersect", "substract" };
+	return names[type];
+}
+
+//一个线程的计数，按缓存行对齐，各线程的计数不会共享缓存行
+struct alignas(64) StatCounters
+{
+	unsigned long long rays;		//FindNearest和射线包求交的射线数
+	unsigned long long tests;		//entity求交测试的次数
+	unsigned long long misses;		//没有交点的射线数
+	unsigned long long nodes;		//加速结构访问的节点数
+	unsigned long long splits;		//白光按N2段分光的次数
+	unsigned long long depth_rays[STAT_DEPTH_NUM];		//各深度的射线数，主射线深度为0
+	unsigned long long shape_tests[STAT_SHAPE_NUM];		//各类型shape的求交次数
+
+	void Reset() { *this = StatCounters(); }
+	void Add(const StatCounters& c)
+	{
+		rays += c.rays;
+		tests += c.tests;
+		misses += c.misses;
+		nodes += c.nodes;
+		splits += c.splits;
+		for (int i = 0; i < STAT_DEPTH_NUM; i++)
+			depth_rays[i] += c.depth_rays[i];
+		for (int i = 0; i < STAT_SHAPE_NUM; i++)
+			shape_tests[i] += c.shape_tests[i];
+	}
+	//entities为场景的entity数，用于判断加速结构是否排除了足够多的entity
+	void Print(std::ostream& out, int entities) const
+	{
+		double per_ray = rays ? 1.0 / rays : 0.0;
+		out << "stats: " << rays << " rays, " << misses << " misses, " << splits << " spectral splits" << std::endl;
+		out << "  per ray: " << tests * per_ray << " of " << entities << " entities tested, "
+			<< nodes * per_ray << " nodes visited" << std::endl;
+		out << "  rays by depth:";
+		for (int i = 0; i < STAT_DEPTH_NUM; i++)
+			if (depth_rays[i])
+				out << " " << i << (i == STAT_DEPTH_NUM - 1 ? "+" : "") << ":" << depth_rays[i];
+		out << std::endl << "  shape tests:";
+		for (int i = 0; i < STAT_SHAPE_NUM; i++)
+			if (shape_tests[i])
+				out << " " << GetStatShapeName(i) << ":" << shape_tests[i];
+		out << std::endl;
+	}
+};
+
+//每个线程写自己的计数，不需要加锁，读取时再合并
+class Stats
+{
+protected:
+	static std::mutex& GetLock()
+	{
+		static std::mutex lock;
+		return lock;
+	}
+	//所有线程的计数，线程结束后仍然保留，便于渲染结束后合并
+	static std::vector<StatCounters*>& GetAll()
+	{
+		static std::vector<StatCounters*> all;
+		return all;
+	}
+	static StatCounters* Register()
+	{
+		StatCounters* c = new StatCounters;
+		c->Reset();
+		std::lock_guard<std::mutex> guard(GetLock());
+		GetAll().push_back(c);
+		return c;
+	}
+public:
+	//为false时暂停计数，用于计时的渲染；计数代码编译进来时仍有一次判断
+	static bool& Active()
+	{
+		static bool active = true;
+		return active;
+	}
+	static StatCounters& Local()
+	{
+		static thread_local StatCounters* counters = Register();
+		return *counters;
+	}
+	//合并所有线程的计数，应在渲染结束后调用
+	static StatCounters Merge()
+	{
+		StatCounters sum;
+		sum.Reset();
+		std::lock_guard<std::mutex> guard(GetLock());
+		for (auto c : GetAll())
+			sum.Add(*c);
+		return sum;
+	}
+	static void Reset()
+	{
+		std::lock_guard<std::mutex> guard(GetLock());
+		for (auto c : GetAll())
+			c->Reset();
+	}
+};
+
+#if ENABLE_STATS
+#define STAT_ADD(name, n) (Stats::Active() ? (void)(Stats::Local().name += (n)) : (void)0)
+#define STAT_RAYS(depth, n) do { if (Stats::Active()) { StatCounters& c_ = Stats::Local(); c_.rays += (n); c_.depth_rays[(depth) < STAT_DEPTH_NUM ? (depth) : STAT_DEPTH_NUM - 1] += (n); } } while (false)
+#define STAT_SHAPE(type, n) (Stats::Active() ? (void)(Stats::Local().shape_tests[type] += (n)) : (void)0)
+#else
+#define STAT_ADD(name, n) ((void)0)
+#define STAT_RAYS(depth, n) ((void)0)
+#define STAT_SHAPE(type, n) ((void)0)
+#endif
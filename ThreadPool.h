@@ -0,0 +1,169 @@
+#pragma once
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <vector>
+#include <functional>
+#include <atomic>
+#include "Trace.h"
+
+//常驻线程池，每个线程有自己的任务队列，空闲时从其他线程的队列中窃取任务
+class ThreadPool
+{
+public:
+	//任务组：多个调用者共用线程池时，各自只等待自己提交的任务
+	struct TaskGroup
+	{
+		std::atomic<int> m_pending;
+		TaskGroup() : m_pending(0) {}
+	};
+protected:
+	struct WorkQueue
+	{
+		std::mutex m_lock;
+		std::deque<std::function<void()>> m_tasks;
+	};
+	std::vector<std::thread> m_threads;
+	std::vector<WorkQueue*> m_queues;
+	std::atomic<int> m_queued;		//已提交但还未被取走的任务数
+	std::atomic<int> m_pending;		//已提交但还未执行完的任务数
+	std::atomic<unsigned> m_next;	//外部线程提交任务时轮流放入各个队列
+	std::mutex m_lock;
+	std::condition_variable m_wake;
+	std::condition_variable m_idle;
+	bool m_stop;
+
+	//当前线程在池中的编号，外部线程为-1
+	static int& CurrentIndex()
+	{
+		static thread_local int index = -1;
+		return index;
+	}
+	//从自己队列的尾部取任务，局部性更好
+	bool Pop(int index, std::function<void()>& task)
+	{
+		WorkQueue* queue = m_queues[index];
+		std::lock_guard<std::mutex> guard(queue->m_lock);
+		if (queue->m_tasks.empty()) return false;
+		task = std::move(queue->m_tasks.back());
+		queue->m_tasks.pop_back();
+		m_queued--;
+		return true;
+	}
+	//从其他队列的头部窃取任务
+	bool Steal(int index, std::function<void()>& task)
+	{
+		int n = (int)m_queues.size();
+		for (int i = 1; i <= n; i++)
+		{
+			WorkQueue* queue = m_queues[(index + i) % n];
+			std::lock_guard<std::mutex> guard(queue->m_lock);
+			if (queue->m_tasks.empty()) continue;
+			task = std::move(queue->m_tasks.front());
+			queue->m_tasks.pop_front();
+			m_queued--;
+			return true;
+		}
+		return false;
+	}
+	void RunTask(std::function<void()>& task)
+	{
+		task();
+		if (--m_pending == 0)
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_idle.notify_all();
+		}
+	}
+	void WorkerLoop(int index)
+	{
+		CurrentIndex() = index;
+		if (Trace::IsEnabled())
+			Trace::SetThreadName("worker", index);
+		while (true)
+		{
+			std::function<void()> task;
+			if (Pop(index, task) || Steal(index, task))
+			{
+				RunTask(task);
+				continue;
+			}
+			std::unique_lock<std::mutex> lock(m_lock);
+			m_wake.wait(lock, [this] { return m_stop || m_queued > 0; });
+			if (m_stop) return;
+		}
+	}
+public:
+	ThreadPool(int thread_num = 0) : m_queued(0), m_pending(0), m_next(0), m_stop(false)
+	{
+		if (thread_num <= 0)
+			thread_num = std::thread::hardware_concurrency();
+		if (thread_num <= 0)
+			thread_num = 1;
+		for (int i = 0; i < thread_num; i++)
+			m_queues.push_back(new WorkQueue);
+		for (int i = 0; i < thread_num; i++)
+			m_threads.push_back(std::thread(&ThreadPool::WorkerLoop, this, i));
+	}
+	~ThreadPool()
+	{
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (auto& t : m_threads)
+			t.join();
+		for (auto queue : m_queues)
+			delete queue;
+	}
+	int GetThreadCount() { return (int)m_threads.size(); }
+	//返回当前线程编号，0~GetThreadCount()-1为工作线程，GetThreadCount()为外部线程
+	int GetWorkerIndex()
+	{
+		int index = CurrentIndex();
+		return index < 0 ? GetThreadCount() : index;
+	}
+	void Submit(std::function<void()> task)
+	{
+		int index = CurrentIndex();
+		if (index < 0)
+			index = m_next++ % m_queues.size();
+		m_pending++;
+		{
+			std::lock_guard<std::mutex> guard(m_queues[index]->m_lock);
+			m_queues[index]->m_tasks.push_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> guard(m_lock);
+			m_queued++;
+		}
+		m_wake.notify_one();
+	}
+	void Submit(std::function<void()> task, TaskGroup& group)
+	{
+		group.m_pending++;
+		Submit([this, task, &group]()
+		{
+			task();
+			if (--group.m_pending == 0)
+			{
+				std::lock_guard<std::mutex> guard(m_lock);
+				m_idle.notify_all();
+			}
+		});
+	}
+	//等待所有任务完成，不能在工作线程中调用
+	void Wait()
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_idle.wait(lock, [this] { return m_pending == 0; });
+	}
+	//只等待group中的任务完成
+	void Wait(TaskGroup& group)
+	{
+		std::unique_lock<std::mutex> lock(m_lock);
+		m_idle.wait(lock, [&group] { return group.m_pending == 0; });
+	}
+};
@@ -0,0 +1,163 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <vector>
+#include <string>
+#include <fstream>
+
+#define TRACE_BUFFER_SIZE 65536		//每个线程环形缓冲区的事件数，写满后覆盖最早的事件
+
+//一段时间区间，begin和end为微秒
+struct TraceEvent
+{
+	const char* name;		//只保存指针，必须是字符串常量
+	double begin, end;
+	int x, y;				//tile的左上角，其他事件为-1
+};
+
+//一个线程的事件，只由该线程写入，输出时再统一读取
+struct TraceBuffer
+{
+	std::vector<TraceEvent> events;
+	std::atomic<unsigned> count;		//写入过的事件总数，超过TRACE_BUFFER_SIZE时只保留最后的部分
+	std::string name;
+	int tid;
+};
+
+//记录各线程的时间线，输出为Chrome trace-event格式的JSON，可以在Perfetto或chrome://tracing中打开
+//未开启时每个记录点只有一次IsEnabled()判断
+class Trace
+{
+protected:
+	static bool& Enabled()
+	{
+		static bool enabled = false;
+		return enabled;
+	}
+	static double& Origin()
+	{
+		static double origin = 0.0;
+		return origin;
+	}
+	static std::mutex& GetLock()
+	{
+		static std::mutex lock;
+		return lock;
+	}
+	static std::vector<TraceBuffer*>& GetAll()
+	{
+		static std::vector<TraceBuffer*> all;
+		return all;
+	}
+	static TraceBuffer* Register()
+	{
+		TraceBuffer* b = new TraceBuffer;
+		b->count = 0;
+		std::lock_guard<std::mutex> guard(GetLock());
+		b->tid = (int)GetAll().size();
+		GetAll().push_back(b);
+		return b;
+	}
+	static TraceBuffer& Local()
+	{
+		static thread_local TraceBuffer* buffer = Register();
+		return *buffer;
+	}
+	static double Clock()
+	{
+		return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now().time_since_epoch()).count();
+	}
+	static void WriteString(std::ostream& out, const std::string& s)
+	{
+		out << '"';
+		for (char c : s)
+		{
+			if (c == '"' || c == '\\') out << '\\';
+			out << c;
+		}
+		out << '"';
+	}
+public:
+	static bool IsEnabled() { return Enabled(); }
+	//开始记录，时间从此刻算起
+	static void Start()
+	{
+		Origin() = Clock();
+		Enabled() = true;
+	}
+	static void Stop() { Enabled() = false; }
+	static double Now() { return Clock() - Origin(); }
+	//给当前线程命名，index >= 0时加在名字后面
+	static void SetThreadName(const char* name, int index = -1)
+	{
+		Local().name = index >= 0 ? name + std::string(" ") + std::to_string(index) : name;
+	}
+	static void Record(const char* name, double begin, double end, int x = -1, int y = -1)
+	{
+		TraceBuffer& b = Local();
+		if (b.events.empty())
+			b.events.resize(TRACE_BUFFER_SIZE);
+		unsigned n = b.count.load(std::memory_order_relaxed);
+		b.events[n % TRACE_BUFFER_SIZE] = { name, begin, end, x, y };
+		b.count.store(n + 1, std::memory_order_release);
+	}
+	//输出所有线程的事件，应在各线程停止记录后调用
+	static bool Write(const std::string& file)
+	{
+		std::ofstream out(file);
+		if (!out)
+			return false;
+		out.setf(std::ios::fixed);
+		out.precision(3);
+		std::lock_guard<std::mutex> guard(GetLock());
+		out << "{\"traceEvents\":[" << std::endl;
+		bool first = true;
+		for (auto b : GetAll())
+		{
+			unsigned count = b->count.load(std::memory_order_acquire);
+			if (!b->name.empty())
+			{
+				out << (first ? "" : ",\n") << "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << b->tid << ",\"args\":{\"name\":";
+				WriteString(out, b->name);
+				out << "}}";
+				first = false;
+			}
+			unsigned begin = count > TRACE_BUFFER_SIZE ? count - TRACE_BUFFER_SIZE : 0;
+			for (unsigned i = begin; i < count; i++)
+			{
+				const TraceEvent& e = b->events[i % TRACE_BUFFER_SIZE];
+				out << (first ? "" : ",\n") << "{\"name\":";
+				WriteString(out, e.name);
+				out << ",\"ph\":\"X\",\"pid\":1,\"tid\":" << b->tid << ",\"ts\":" << e.begin << ",\"dur\":" << e.end - e.begin;
+				if (e.x >= 0)
+					out << ",\"args\":{\"x\":" << e.x << ",\"y\":" << e.y << "}";
+				out << "}";
+				first = false;
+			}
+		}
+		out << std::endl << "]}" << std::endl;
+		return true;
+	}
+};
+
+//记录从构造到析构的一段时间
+class TraceScope
+{
+protected:
+	const char* m_name;
+	double m_begin;
+	int m_x, m_y;
+	bool m_active;
+public:
+	TraceScope(const char* name, int x = -1, int y = -1) : m_name(name), m_x(x), m_y(y), m_active(Trace::IsEnabled())
+	{
+		if (m_active)
+			m_begin = Trace::Now();
+	}
+	~TraceScope()
+	{
+		if (m_active)
+			Trace::Record(m_name, m_begin, Trace::Now(), m_x, m_y);
+	}
+};
@@ -98,3 +98,35 @@ struct Color
 		return (r + g + b < c.r + c.g + c.b);
 	}
 };
+
+//二维包围盒，up < down
+struct Bound
+{
+	float left, right, up, down;
+	void Reset()
+	{
+		left = up = 1e30f;
+		right = down = -1e30f;
+	}
+	void Expand(const Bound& b)
+	{
+		left = fminf(left, b.left), right = fmaxf(right, b.right);
+		up = fminf(up, b.up), down = fmaxf(down, b.down);
+	}
+	//二维中用周长代替表面积
+	float Perimeter()
+	{
+		if (right < left || down < up) return 0.f;
+		return 2.f * ((right - left) + (down - up));
+	}
+	//射线进入包围盒的距离，不相交返回false，p在盒内时为0
+	bool Intersect(Point p, Vector inv_d, float max_dist, float& t_near) const
+	{
+		float tx1 = (left - p.x) * inv_d.x, tx2 = (right - p.x) * inv_d.x;
+		float ty1 = (up - p.y) * inv_d.y, ty2 = (down - p.y) * inv_d.y;
+		float t_min = fmaxf(fminf(tx1, tx2), fminf(ty1, ty2));
+		float t_max = fminf(fmaxf(tx1, tx2), fmaxf(ty1, ty2));
+		t_near = fmaxf(t_min, 0.f);
+		return t_max >= t_near && t_near <= max_dist;
+	}
+};
\ No newline at end of file
@@ -0,0 +1,247 @@
+// 性能测试：对Example.h中的场景按不同分辨率、采样数、线程数和加速结构渲染，输出JSON
+// 用--entities生成不同规模的大场景，观察各加速结构的构建时间、内存和射线速度随entity数的变化
+// 单独编译成一个程序，不与light.cpp链接
+#define ENABLE_STATS true
+#include <math.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include "basic.h"
+#include "Example.h"
+#include "Renderer.h"
+#include "Stats.h"
+
+//benchmark不画调试线
+void drawLine(Point p1, Point p2) {}
+
+Shape* GeneratePolygon(initializer_list<Point> points)
+{
+	return new ConvexPolygon(vector<Point>(points));
+}
+
+struct BenchmarkResult
+{
+	string scene;
+	int entities;
+	int width, height, samples, threads;
+	AccelType accel;
+	vector<double> times;		//每次重复的墙钟时间，计时时不计数
+	StatCounters counters;		//另外一次不计时渲染的射线数和求交次数
+	bool specialized;
+	double build_time;			//加速结构的构建时间
+	size_t accel_memory;		//加速结构占用的内存(字节)
+};
+
+struct BenchmarkOptions
+{
+	vector<int> sizes = { 128, 256 };
+	vector<int> samples = { 16, 64 };
+	vector<int> threads = { 1, 0 };		//0表示硬件线程数
+	vector<AccelType> accels = { ACCEL_LIST, ACCEL_BVH };
+	vector<string> scenes;				//空表示所有内置场景
+	vector<int> entities;				//生成的大场景的entity数，非空时不再默认测试内置场景
+	vector<string> layouts = { "uniform", "clustered" };
+	int list_limit = 2000;				//entity数超过此值时跳过逐个测试，否则太慢
+	int warmup = 1;
+	int repeat = 3;
+	string output = "benchmark.json";
+};
+
+vector<int> ParseIntList(const char* s)
+{
+	vector<int> list;
+	stringstream ss(s);
+	string item;
+	while (getline(ss, item, ','))
+		list.push_back(atoi(item.c_str()));
+	return list;
+}
+
+void PrintUsage(const char* name)
+{
+	cerr << "usage: " << name << " [options]" << endl
+		<< "  --sizes 128,256          image sizes (square)" << endl
+		<< "  --samples 16,64          samples per pixel" << endl
+		<< "  --threads 1,0            thread counts, 0 = all hardware threads" << endl
+		<< "  --accel list,bvh         accelerators (list, quadtree, bvh, grid)" << endl
+		<< "  --scene name             only this scene (built-in, uniform:n, clustered:n or file), can be repeated" << endl
+		<< "  --entities 1000,100000   also generate scenes with this many entities" << endl
+		<< "  --layout uniform,clustered  placement of the generated entities" << endl
+		<< "  --list-limit n           skip the list accelerator above n entities (2000)" << endl
+		<< "  --warmup n, --repeat n   untimed and timed runs per configuration (1, 3)" << endl
+		<< "  --out file               JSON output (benchmark.json)" << endl;
+}
+
+bool ParseOptions(int argc, char** argv, BenchmarkOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (i + 1 >= argc)
+			return false;
+		const char* value = argv[++i];
+		if (!strcmp(arg, "--sizes")) options.sizes = ParseIntList(value);
+		else if (!strcmp(arg, "--samples")) options.samples = ParseIntList(value);
+		else if (!strcmp(arg, "--threads")) options.threads = ParseIntList(value);
+		else if (!strcmp(arg, "--scene")) options.scenes.push_back(value);
+		else if (!strcmp(arg, "--entities")) options.entities = ParseIntList(value);
+		else if (!strcmp(arg, "--list-limit")) options.list_limit = atoi(value);
+		else if (!strcmp(arg, "--layout"))
+		{
+			options.layouts.clear();
+			stringstream ss(value);
+			string item;
+			while (getline(ss, item, ','))
+			{
+				if (item != "uniform" && item != "clustered")
+					return false;
+				options.layouts.push_back(item);
+			}
+		}
+		else if (!strcmp(arg, "--warmup")) options.warmup = atoi(value);
+		else if (!strcmp(arg, "--repeat")) options.repeat = atoi(value);
+		else if (!strcmp(arg, "--out")) options.output = value;
+		else if (!strcmp(arg, "--accel"))
+		{
+			options.accels.clear();
+			stringstream ss(value);
+			string item;
+			while (getline(ss, item, ','))
+			{
+				int k = 0;
+				while (k < ACCEL_NUM && item != GetAccelName((AccelType)k))
+					k++;
+				if (k == ACCEL_NUM)
+					return false;
+				options.accels.push_back((AccelType)k);
+			}
+		}
+		else
+			return false;
+	}
+	return options.repeat > 0 && !options.sizes.empty() && !options.samples.empty() && !options.threads.empty() && !options.accels.empty();
+}
+
+double GetMedian(vector<double> v)
+{
+	sort(v.begin(), v.end());
+	return v.size() % 2 ? v[v.size() / 2] : (v[v.size() / 2 - 1] + v[v.size() / 2]) / 2.0;
+}
+
+void WriteJson(ostream& out, const vector<BenchmarkResult>& results)
+{
+	out << "{" << endl;
+	out << "  \"simd\": \"" << GetSimdName(ActiveSimdLevel()) << "\"," << endl;
+	out << "  \"hardware_threads\": " << std::thread::hardware_concurrency() << "," << endl;
+	out << "  \"results\": [" << endl;
+	for (size_t i = 0; i < results.size(); i++)
+	{
+		const BenchmarkResult& r = results[i];
+		double best = *min_element(r.times.begin(), r.times.end());
+		double median = GetMedian(r.times);
+		double pixels = (double)r.width * r.height;
+		out << "    { \"scene\": \"" << r.scene << "\", \"entities\": " << r.entities << ", \"width\": " << r.width << ", \"height\": " << r.height
+			<< ", \"samples\": " << r.samples << ", \"threads\": " << r.threads << ", \"accel\": \"" << GetAccelName(r.accel)
+			<< "\", \"specialized\": " << (r.specialized ? "true" : "false")
+			<< ", \"build_time\": " << r.build_time << ", \"accel_memory\": " << r.accel_memory
+			<< ", \"times\": [";
+		for (size_t k = 0; k < r.times.size(); k++)
+			out << (k ? ", " : "") << r.times[k];
+		out << "], \"time_min\": " << best << ", \"time_median\": " << median
+			<< ", \"rays\": " << r.counters.rays << ", \"rays_per_sec\": " << r.counters.rays / median
+			<< ", \"tests_per_ray\": " << (r.counters.rays ? (double)r.counters.tests / r.counters.rays : 0.0)
+			<< ", \"nodes_per_ray\": " << (r.counters.rays ? (double)r.counters.nodes / r.counters.rays : 0.0)
+			<< ", \"misses\": " << r.counters.misses << ", \"splits\": " << r.counters.splits
+			<< ", \"ns_per_pixel\": " << median * 1e9 / pixels << " }" << (i + 1 < results.size() ? "," : "") << endl;
+	}
+	out << "  ]" << endl;
+	out << "}" << endl;
+}
+
+int main(int argc, char** argv)
+{
+	BenchmarkOptions options;
+	if (!ParseOptions(argc, argv, options))
+	{
+		PrintUsage(argv[0]);
+		return 1;
+	}
+	int count;
+	const SceneEntry* entries = GetSceneEntries(count);
+	//内置场景、生成的大场景和场景文件都按名字交给CreateScene
+	vector<string> names = options.scenes;
+	if (names.empty() && options.entities.empty())
+		for (int e = 0; e < count; e++)
+			names.push_back(entries[e].name);
+	for (auto& layout : options.layouts)
+		for (int n : options.entities)
+			names.push_back(layout + ":" + to_string(n));
+	vector<BenchmarkResult> results;
+	vector<int> thread_counts;
+	for (int t : options.threads)
+	{
+		if (t <= 0)
+			t = max((int)std::thread::hardware_concurrency(), 1);
+		if (find(thread_counts.begin(), thread_counts.end(), t) == thread_counts.end())
+			thread_counts.push_back(t);
+	}
+	for (int t : thread_counts)
+	{
+		ThreadPool pool(t);
+		Renderer renderer(&pool);
+		for (auto& name : names)
+		{
+			Scene* s = CreateScene(name, RenderSettings());
+			if (!s)
+				continue;
+			int entities = (int)s->GetEntities().size();
+			for (AccelType accel : options.accels)
+			{
+				if (accel == ACCEL_LIST && entities > options.list_limit)
+				{
+					cout << name << " " << GetAccelName(accel) << ": skipped, " << entities << " entities" << endl;
+					continue;
+				}
+				for (int size : options.sizes)
+					for (int samples : options.samples)
+					{
+						RenderSettings settings;
+						settings.width = settings.height = size;
+						settings.samples = samples;
+						settings.accel = accel;
+						s->Configure(settings);
+						FrameBuffer frame(size, size);
+						auto shader = [s, size](int x, int y) { return s->Sample({ (float)x / size, (float)y / size }, y * size + x, 0); };
+						BenchmarkResult r = { name, entities, size, size, samples, pool.GetThreadCount(), accel, {}, {},
+							s->IsSpecialized(), accel == ACCEL_LIST ? 0.0 : s->GetBuildTime(), s->GetAccelMemoryUsage() };
+						Stats::Active() = false;
+						for (int i = 0; i < options.warmup; i++)
+							renderer.Render(frame, shader);
+						for (int i = 0; i < options.repeat; i++)
+						{
+							renderer.Render(frame, shader);
+							r.times.push_back(renderer.GetWallTime());
+						}
+						//计数单独渲染一次，不影响上面的计时；每次渲染的射线相同
+						Stats::Active() = true;
+						Stats::Reset();
+						renderer.Render(frame, shader);
+						r.counters = Stats::Merge();
+						double median = GetMedian(r.times);
+						cout << r.scene << " " << size << "x" << size << " " << samples << "spp " << r.threads << " threads "
+							<< GetAccelName(accel) << ": " << median << "s, " << r.counters.rays / median << " rays/s, "
+							<< (r.counters.rays ? (double)r.counters.tests / r.counters.rays : 0.0) << " tests/ray, "
+							<< median * 1e9 / (size * size) << " ns/pixel, build " << r.build_time << "s, "
+							<< r.accel_memory << " bytes" << endl;
+						results.push_back(r);
+					}
+			}
+			delete s;
+		}
+	}
+	ofstream out(options.output);
+	WriteJson(out, results);
+	cout << "written " << options.output << endl;
+	return 0;
+}
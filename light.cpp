@@ -1,4 +1,3 @@
-#include "svpng.inc"
 #include <math.h> // fabsf(), fminf(), fmaxf(), sinf(), cosf(), sqrt()
 #include <stdlib.h> // rand(), RAND_MAX
 #include <iostream>
@@ -6,13 +5,31 @@
 #include "basic.h"
 #include "time.h"
 #include "Example.h"
+#include "Renderer.h"
+#include "LightTracer.h"
+#include "Denoiser.h"
+#include "Distributed.h"
+#include "RenderServer.h"
+#include "PngWriter.h"
 #include <initializer_list>
 using std::initializer_list;
 
-#define W 512
-#define H 512
+RenderSettings settings;			//由命令行参数得到的渲染参数
+vector<unsigned char> img_buffer;
+unsigned char* img = NULL;		//色调映射后的8位图像，调试时的线也画在这里
+FrameBuffer frame;				//浮点累加缓冲区，自适应采样时的采样次数即每个像素的采样轮数
 
-unsigned char img[W * H * 3];
+void ResizeImage(int width, int height)
+{
+	img_buffer.assign(width * height * 3, 0);
+	img = img_buffer.data();
+	frame.Resize(width, height);
+}
+
+Color SamplePixel(Scene* s, int x, int y, unsigned int seed)
+{
+	return s->Sample({ (float)x / settings.width, (float)y / settings.height }, y * settings.width + x, seed);
+}
 
 //用于截断画布外的线段，使p1和p2均处在画布内
 void validate(Point& p1, Point& p2)
@@ -33,14 +50,14 @@ void validate(Point& p1, Point& p2)
 void drawLine(Point p1, Point p2) {
 	validate(p1, p2);
 	//if (!p1.IsValid() || !p2.IsValid()) return;
-	int x0 = p1.x * W;
-	int x1 = p2.x * W;
-	int y0 = p1.y * H;
-	int y1 = p2.y * H;
+	int x0 = p1.x * settings.width;
+	int x1 = p2.x * settings.width;
+	int y0 = p1.y * settings.height;
+	int y1 = p2.y * settings.height;
 	int dx = abs(x1 - x0), sx = x0 < x1 ? 1 : -1;
 	int dy = abs(y1 - y0), sy = y0 < y1 ? 1 : -1;
 	int err = (dx > dy ? dx : -dy) / 2;
-	while (*(img + (y0 * W + x0) * 3) = 255, x0 != x1 || y0 != y1) {
+	while (*(img + (y0 * settings.width + x0) * 3) = 255, x0 != x1 || y0 != y1) {
 		int e2 = err;
 		if (e2 > -dx) { err -= dy; x0 += sx; }
 		if (e2 <  dy) { err += dx; y0 += sy; }
@@ -51,26 +68,7 @@ void drawLine(Point p1, Point p2) {
 //生成多边形
 Shape* GeneratePolygon(initializer_list<Point> points)
 {
-	Point sum = { 0.f, 0.f };
-	for (auto p : points)
-	{
-		sum.x += p.x;
-		sum.y += p.y;
-	}
-	Point center = { sum.x / points.size(), sum.y / points.size() };
-	Shape* si = NULL;
-	for (auto i = points.begin(); i + 1 != points.end(); i++)
-	{
-		Point p1 = *i;
-		Point p2 = *(i + 1);
-		Line* l = new Line(p1, p2, center);
-		if (si)
-			si = new ShapeIntersect(si, l);
-		else
-			si = l;
-	}
-	si = new ShapeIntersect(si, new Line(*(points.begin()), *(points.end() - 1), center));
-	return si;
+	return new ConvexPolygon(vector<Point>(points));
 }
 
 void main_drawrainbow()
@@ -95,9 +93,10 @@ void main_drawrainbow()
 		cout <<a[i][0]<<" "<< a[i][1] << " " << a[i][2] << " " << a[i][3] << endl;
 	}
 	getchar();
+	ResizeImage(settings.width, settings.height);
 	unsigned char* p = img;
-	for (int y = 0; y < H; y++)
-		for (int x = 0; x < W; x++, p += 3)
+	for (int y = 0; y < settings.height; y++)
+		for (int x = 0; x < settings.width; x++, p += 3)
 		{
 			int idx = y / 7+3;
 			float sum = a[idx][1] + a[idx][2] + a[idx][3] + 0.001;
@@ -125,37 +124,303 @@ void main_drawrainbow()
 			p[1] = (int)fminf(color.g *255.0f, 255.0f);
 			p[2] = (int)fminf(color.b *255.0f, 255.0f);
 		}
-	svpng(fopen("rainbow.png", "wb"), W, H, img, 0);
+	PngWriter::Write("rainbow.png", img, settings.width, settings.height);
+}
+
+//测试不同线程数下的渲染时间，检查并行扩展性
+void main_scaling(Scene* s)
+{
+	ResizeImage(settings.width, settings.height);
+	int max_threads = std::thread::hardware_concurrency();
+	double base_time = 0.0;
+	for (int n = 1; ; n = std::min(n * 2, max_threads))
+	{
+		ThreadPool pool(n);
+		Renderer renderer(&pool);
+		renderer.Render(frame, [s](int x, int y) { return SamplePixel(s, x, y, settings.seed); });
+		if (n == 1)
+			base_time = renderer.GetWallTime();
+		cout << "speedup: " << base_time / renderer.GetWallTime() << ", ";
+		renderer.PrintStats(cout);
+		if (n >= max_threads)
+			break;
+	}
+}
+
+//比较各指令集下射线包求交的速度，射线数只统计首次射线
+void main_simdbench()
+{
+	Scene* (*scenes[])() = { GenerateScene, GenerateScene2, GenerateScene3, GenerateScene4, GenerateScene6, GenerateScene7 };
+	const char* names[] = { "scene1", "scene2", "scene3", "scene4", "scene6", "scene7" };
+	SimdLevel detected = DetectSimdLevel();
+	ResizeImage(settings.width, settings.height);
+	ThreadPool pool;
+	Renderer renderer(&pool);
+	for (size_t k = 0; k < sizeof(scenes) / sizeof(scenes[0]); k++)
+	{
+		Scene* s = scenes[k]();
+		s->Configure(settings);
+		double scalar_rate = 0.0;
+		for (int level = SIMD_SCALAR; level <= detected; level++)
+		{
+			ActiveSimdLevel() = (SimdLevel)level;
+			renderer.Render(frame, [s](int x, int y) { return SamplePixel(s, x, y, settings.seed); });
+			double rate = (double)settings.width * settings.height * settings.samples / renderer.GetWallTime();
+			if (level == SIMD_SCALAR)
+				scalar_rate = rate;
+			cout << names[k] << " " << GetSimdName((SimdLevel)level) << ": " << rate << " rays/s, x" << rate / scalar_rate << endl;
+		}
+		delete s;
+	}
+	ActiveSimdLevel() = detected;
+}
+
+//同一个程序依次渲染多种分辨率和采样数，不需要重新编译
+void main_sweep(Scene* s)
+{
+	int sizes[] = { 128, 256, 512 };
+	int samples[] = { 8, 16, 32, 64 };
+	RenderSettings base = settings;
+	ThreadPool pool;
+	Renderer renderer(&pool);
+	for (int size : sizes)
+		for (int n : samples)
+		{
+			settings.width = settings.height = size;
+			settings.samples = n;
+			s->Configure(settings);
+			ResizeImage(size, size);
+			renderer.Render(frame, [s](int x, int y) { return SamplePixel(s, x, y, settings.seed); });
+			double rate = (double)size * size * n / renderer.GetWallTime();
+			cout << size << "x" << size << ", " << n << " samples" << (s->IsSpecialized() ? "" : " (generic)") << ": "
+				<< renderer.GetWallTime() << "s, " << rate << " rays/s" << endl;
+		}
+	settings = base;
+	s->Configure(settings);
+}
+
+//把保存的PFM按新的曝光和gamma重新输出，不需要重新渲染
+void main_tonemap()
+{
+	if (!frame.ReadPfm(settings.tonemap))
+	{
+		cerr << "cannot read " << settings.tonemap << endl;
+		return;
+	}
+	vector<unsigned char> ldr(frame.GetWidth() * frame.GetHeight() * 3);
+	frame.Tonemap(ldr.data(), settings.exposure, settings.gamma);
+	if (!PngWriter::Write("reflect.png", ldr.data(), frame.GetWidth(), frame.GetHeight()))
+		cerr << "cannot write reflect.png" << endl;
 }
 
-void main() {
+void main(int argc, char** argv) {
+	if (!settings.Parse(argc, argv))
+		return;
+	if (!settings.tonemap.empty())
+	{
+		main_tonemap();
+		return;
+	}
+	if (settings.simd_bench)
+	{
+		main_simdbench();
+		return;
+	}
 	time_t a = time(NULL);
 	int star_num = 1;
-	Scene* s = GenerateSceneDiamond();
-	unsigned char* p = img;
-	if (!IS_DEBUG)
-		for (int y = 0; y < H; y++)
-			for (int x = 0; x < W; x++, p += 3)
+	if (!settings.trace.empty())
+	{
+		Trace::Start();
+		Trace::SetThreadName("main");
+	}
+	Scene* s;
+	{
+		TraceScope trace("scene build");
+		s = settings.scene.empty() ? GenerateSceneDiamond() : CreateScene(settings.scene, settings);
+	}
+	if (!s)
+	{
+		cerr << "unknown scene: " << settings.scene << endl;
+		return;
+	}
+	s->Configure(settings);
+	settings.Print(cout);
+	if (!settings.accel_cache.empty() && (settings.accel == ACCEL_QUADTREE || settings.accel == ACCEL_BVH))
+		cout << "accelerator cache: " << (s->GetAccelCache().IsLoaded() ? "mapped " : "built and wrote ") << s->GetAccelCache().GetPath() << endl;
+	if (!s->IsSpecialized())
+		cout << "no specialized kernel for these settings, using the generic one" << endl;
+	if (settings.sweep)
+	{
+		main_sweep(s);
+		delete s;
+		return;
+	}
+	if (settings.scaling)
+	{
+		main_scaling(s);
+		delete s;
+		return;
+	}
+	if (settings.serve)
+	{
+		//场景和加速结构只建一次，之后的请求只做追踪
+		ThreadPool pool(settings.threads);
+		RenderServer server(&pool, settings, s, [](const string& name) -> Scene*
+		{
+			//一条请求不能生成占满内存的大场景
+			LargeSceneParams params;
+			if (ParseLargeScene(name, params) && params.count > SERVE_MAX_ENTITIES)
+				return NULL;
+			return CreateScene(name, settings, settings.serve_dir);
+		});
+		if (settings.port > 0)
+		{
+			if (!server.Serve(settings.port, cout, settings.listen_address))
+				cerr << "cannot listen on " << settings.listen_address << ":" << settings.port << endl;
+		}
+		else
+			server.Serve(cin, cout);
+		server.PrintStats(cout);
+		delete s;
+		return;
+	}
+	const int width = settings.width, height = settings.height;
+	ThreadPool pool(settings.threads);
+	Renderer renderer(&pool);
+	//渲染图像中的一块，fb与tile大小相同；分布式渲染的tile与TILE_SIZE对齐，结果与本地渲染相同
+	auto render_tile = [s, &renderer](FrameBuffer& fb, const Tile& tile, unsigned int seed)
+	{
+		if (settings.adaptive)
+			renderer.RenderAdaptive(fb, [s, tile, seed](int x, int y, int k) { return SamplePixel(s, tile.x0 + x, tile.y0 + y, seed + k * 0x9e3779b9u); });
+		else
+			renderer.Render(fb, [s, tile, seed](int x, int y) { return SamplePixel(s, tile.x0 + x, tile.y0 + y, seed); });
+	};
+	if (!settings.worker.empty())
+	{
+		TileWorker::Run(settings.worker, settings.Fingerprint(), pool.GetThreadCount(), render_tile);
+		delete s;
+		return;
+	}
+	ResizeImage(width, height);
+	if (settings.accel == ACCEL_QUADTREE)
+		s->GetEntityTree()->PrintStats(cout);
+	else if (settings.accel == ACCEL_GRID)
+		s->GetEntityGrid()->PrintStats(cout);
+	LightTracer tracer(s, &pool);
+	PngWriter png("reflect.png", img, width, height);
+	if (settings.progressive && !settings.debug && !settings.light_trace)
+	{
+		//预览：从1/2^PROGRESSIVE_LEVELS分辨率开始，分辨率每次加倍，采样数也随之增加，各级结果在frame中累加后输出preview.png
+		//预览的采样只用于显示，正式渲染前丢弃
+		for (int level = PROGRESSIVE_LEVELS; level > 0; level--)
+		{
+			int stride = 1 << level;
+			s->SetSamples(max(settings.samples >> level, 1));
+			renderer.Render(frame, [s](int x, int y) { return SamplePixel(s, x, y, settings.seed); }, stride);
+			frame.TonemapPreview(img, stride, settings.exposure, settings.gamma);
+			if (!PngWriter::Write("preview.png", img, width, height))
+				cerr << "cannot write preview.png" << endl;
+			cout << "preview 1/" << stride << ": " << s->GetSettings().samples << " samples, " << renderer.GetWallTime() << "s" << endl;
+		}
+		//完整分辨率从空的frame开始，保证结果与不预览时相同；沿用预览的采样会把每个像素的分层采样拆成几组，
+		//实测预览过的像素误差约增大一倍，而省下的时间只有百分之几
+		s->SetSamples(settings.samples);
+		frame.Clear();
+	}
+	if (!settings.debug)
+	{
+		//tile的最后一轮完成后立即做色调映射，行带的tile都完成后开始压缩；降噪时要等整幅图像完成
+		auto on_tile = [&png](const Tile& tile)
+		{
 			{
-				Color color = s->Sample({ (float)x / W, (float)y / H });
-				p[0] = (int)fminf(color.r *255.0f, 255.0f);
-				p[1] = (int)fminf(color.g *255.0f, 255.0f);
-				p[2] = (int)fminf(color.b *255.0f, 255.0f);
+				TraceScope trace("tonemap", tile.x0, tile.y0);
+				frame.Tonemap(img, tile.x0, tile.y0, tile.x1, tile.y1, settings.exposure, settings.gamma);
 			}
-	else
-	{
-		for (int y = 0; y < H; y++)
-			for (int x = 0; x < W; x++, p += 3)
+			png.AddRect(tile.x0, tile.y0, tile.x1, tile.y1);
+		};
+		//每轮的种子相差ADAPTIVE_MAX_PASS个自适应轮次，第0轮与只渲染一轮时的结果相同
+		vector<unsigned int> seeds;
+		for (int pass = 0; pass < settings.passes; pass++)
+			seeds.push_back(settings.seed + pass * ADAPTIVE_MAX_PASS * 0x9e3779b9u);
+		if ((settings.workers > 0 || settings.port > 0) && !settings.light_trace)
+		{
+			//所有轮次的tile一起分配给worker进程，协调进程只负责合并
+			TileCoordinator coordinator(settings.Fingerprint(), render_tile);
+			//只用--workers时worker都在本机，只监听127.0.0.1；显式给出--listen时才按--bind接受其他机器
+			string address = settings.port > 0 ? settings.listen_address : "127.0.0.1";
+			if (!coordinator.Listen(settings.port, address))
+				cerr << "cannot listen on " << address << ":" << settings.port << ", rendering locally" << endl;
+			else
+			{
+				cout << "listening on port " << coordinator.GetPort() << endl;
+				if (settings.workers > 0 && !coordinator.Spawn(argc, argv, settings.workers, max((int)std::thread::hardware_concurrency() / settings.workers, 1)))
+					cerr << "cannot start worker processes" << endl;
+			}
+			if (!settings.denoise)
+				coordinator.SetTileCallback(on_tile);
+			coordinator.Render(frame, seeds);
+			coordinator.PrintStats(cout);
+		}
+		else for (int pass = 0; pass < settings.passes; pass++)
+		{
+			if (pass + 1 == settings.passes && !settings.denoise)
+			{
+				renderer.SetTileCallback(on_tile);
+				tracer.SetTileCallback(on_tile);
+			}
+			unsigned int seed = seeds[pass];
+			if (settings.light_trace)
+			{
+				tracer.Render(frame, settings.light_paths, seed);
+				tracer.PrintStats(cout);
+				continue;
+			}
+			if (settings.adaptive)
 			{
-				Color color = s->GetBaseColor({ (float)x / W, (float)y / H });
-				p[0] = (int)fminf(color.r *255.0f, 255.0f);
-				p[1] = (int)fminf(color.g *255.0f, 255.0f);
-				p[2] = (int)fminf(color.b *255.0f, 255.0f);
+				//每个自适应轮次也换一个种子
+				renderer.RenderAdaptive(frame, [s, seed](int x, int y, int k) { return SamplePixel(s, x, y, seed + k * 0x9e3779b9u); });
 			}
+			else
+				renderer.Render(frame, [s, seed](int x, int y) { return SamplePixel(s, x, y, seed); });
+			renderer.PrintStats(cout);
+		}
+		if (settings.denoise)
+		{
+			Denoiser denoiser(&pool);
+			denoiser.BuildGuides(s, width, height);
+			denoiser.Filter(frame);
+			denoiser.PrintStats(cout);
+			frame.Tonemap(img, settings.exposure, settings.gamma);
+			png.AddRect(0, 0, width, height);
+		}
+#if ENABLE_STATS
+		Stats::Merge().Print(cout, (int)s->GetEntities().size());
+#endif
+	}
+	else
+	{
+		renderer.Render(frame, [s, width, height](int x, int y) { return s->GetBaseColor({ (float)x / width, (float)y / height }); });
+		frame.Tonemap(img, settings.exposure, settings.gamma);
 		s->Sample({ 0.76f, 0.16f });
 	}
-	svpng(fopen("reflect.png", "wb"), W, H, img, 0);
-	if (IS_DEBUG)
+	if (!png.Finish())
+		cerr << "cannot write reflect.png" << endl;
+	if (!settings.hdr.empty() && !frame.WritePfm(settings.hdr))
+		cerr << "cannot write " << settings.hdr << endl;
+	if (settings.adaptive && !settings.debug && !settings.light_trace)
+	{
+		//输出采样数热力图
+		const int* counts = frame.GetCounts();
+		const int max_count = ADAPTIVE_MAX_PASS * settings.passes;
+		long long total = 0;
+		for (int i = 0; i < width * height; i++)
+			total += counts[i];
+		cout << "adaptive: " << (double)total * settings.samples / (width * height) << " rays/pixel, max " << settings.samples * max_count << endl;
+		vector<unsigned char> heatmap(width * height * 3);
+		Renderer::WriteHeatmap(heatmap.data(), counts, width, height, max_count);
+		PngWriter::Write("samples.png", heatmap.data(), width, height);
+	}
+	if (settings.debug)
 	{
 		cout << "done!" << endl;
 		getchar();
@@ -166,7 +431,14 @@ void main() {
 		time_t b = time(NULL);
 		ofstream SaveFile("time_record.csv", ios::app);
 		struct tm * timeinfo = localtime(&b);
-		SaveFile << asctime(timeinfo) <<","<<N << "," << MAX_DEPTH << "," << TREE_DEPTH << "," << star_num << "," << (b - a) <<",diamond" <<endl;
+		SaveFile << asctime(timeinfo) <<","<<settings.samples << "," << settings.max_depth << "," << settings.tree_depth << "," << star_num << "," << (b - a) <<",diamond" <<endl;
 		SaveFile.close();
 	}
+	if (!settings.trace.empty())
+	{
+		Trace::Stop();
+		if (!Trace::Write(settings.trace))
+			cerr << "cannot write " << settings.trace << endl;
+	}
+	delete s;
 }